@@ -0,0 +1,185 @@
+/* arena.c - chunked bump allocator
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef NK_ARENA_GUARD
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "nk/arena.h"
+#include "nk/log.h"
+
+struct nk_arena_chunk {
+    struct nk_arena_chunk *prev;
+    size_t size;  // usable bytes in data
+    size_t seq;
+    max_align_t data[];
+};
+
+void nk_arena_init(struct nk_arena *a, size_t chunk_size)
+{
+    memset(a, 0, sizeof *a);
+    a->chunk_size = chunk_size ? chunk_size : NK_ARENA_DEFAULT_CHUNK;
+}
+
+static char *nk_arena_data(struct nk_arena_chunk *c)
+{
+    return (char *)c->data;
+}
+
+#ifdef NK_ARENA_GUARD
+static struct nk_arena_chunk *nk_arena_chunk_new(size_t size)
+{
+    size_t pg = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len = (sizeof(struct nk_arena_chunk) + size + pg - 1) & ~(pg - 1);
+    char *p = mmap(NULL, len + pg, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        suicide("%s: mmap failed: %s", __func__, strerror(errno));
+    if (mprotect(p + len, pg, PROT_NONE))
+        suicide("%s: mprotect failed: %s", __func__, strerror(errno));
+    struct nk_arena_chunk *c = (struct nk_arena_chunk *)p;
+    c->size = len - sizeof *c;
+    return c;
+}
+
+static void nk_arena_chunk_free(struct nk_arena *a, struct nk_arena_chunk *c)
+{
+    (void)a;
+    size_t pg = (size_t)sysconf(_SC_PAGESIZE);
+    munmap(c, sizeof *c + c->size + pg);
+}
+#else
+static struct nk_arena_chunk *nk_arena_chunk_new(size_t size)
+{
+    struct nk_arena_chunk *c = malloc(sizeof *c + size);
+    if (!c)
+        suicide("%s: malloc failed", __func__);
+    c->size = size;
+    return c;
+}
+
+static void nk_arena_chunk_free(struct nk_arena *a, struct nk_arena_chunk *c)
+{
+    if (c->size == a->chunk_size) {
+        c->prev = a->spare;
+        a->spare = c;
+        return;
+    }
+    free(c);
+}
+#endif
+
+void nk_arena_destroy(struct nk_arena *a)
+{
+    nk_arena_reset(a);
+    for (struct nk_arena_chunk *c = a->spare, *p; c; c = p) {
+        p = c->prev;
+        free(c);
+    }
+    a->spare = NULL;
+}
+
+// Called by nk_arena_alloc_aligned() when the current chunk is full.
+// Requests larger than a quarter chunk get a chunk of their own, which is
+// linked behind the current one so that its free space is not abandoned.
+void *nk_arena_alloc_slow(struct nk_arena *a, size_t size, size_t align)
+{
+    if (!align || (align & (align - 1)))
+        suicide("%s: alignment %zu is not a power of two", __func__, align);
+    if (size > SIZE_MAX / 2 - align)
+        suicide("%s: size %zu is too large", __func__, size);
+    size_t need = size + (align > NK_ARENA_ALIGN ? align - 1 : 0);
+    struct nk_arena_chunk *c;
+    if (need > a->chunk_size / 4) {
+        c = nk_arena_chunk_new(need);
+        c->seq = ++a->seq;
+        if (a->head) {
+            c->prev = a->head->prev;
+            a->head->prev = c;
+            uintptr_t p = ((uintptr_t)nk_arena_data(c) + (align - 1))
+                          & ~(uintptr_t)(align - 1);
+            return (void *)p;
+        }
+        c->prev = NULL;
+        a->head = c;
+    } else {
+        if (a->spare) {
+            c = a->spare;
+            a->spare = c->prev;
+        } else {
+            c = nk_arena_chunk_new(a->chunk_size);
+        }
+        c->seq = ++a->seq;
+        c->prev = a->head;
+        a->head = c;
+    }
+    a->pos = nk_arena_data(c);
+    a->end = a->pos + c->size;
+    uintptr_t p = ((uintptr_t)a->pos + (align - 1)) & ~(uintptr_t)(align - 1);
+    a->pos = (char *)p + size;
+    return (void *)p;
+}
+
+// Releases everything allocated after m was taken.  Chunks that were
+// created after m are on the list ahead of m.chunk, or, if they are
+// dedicated to a large request, directly behind it.
+void nk_arena_reset_to(struct nk_arena *a, struct nk_arena_mark m)
+{
+    while (a->head && a->head != m.chunk) {
+        struct nk_arena_chunk *c = a->head;
+        a->head = c->prev;
+        nk_arena_chunk_free(a, c);
+    }
+    if (!a->head) {
+        a->pos = a->end = NULL;
+        return;
+    }
+    while (a->head->prev && a->head->prev->seq > m.seq) {
+        struct nk_arena_chunk *c = a->head->prev;
+        a->head->prev = c->prev;
+        nk_arena_chunk_free(a, c);
+    }
+    a->pos = m.pos;
+    a->end = nk_arena_data(a->head) + a->head->size;
+}
+
+char *nk_arena_strdup(struct nk_arena *a, const char *s)
+{
+    return nk_arena_memdup(a, s, strlen(s) + 1);
+}
+
+void *nk_arena_memdup(struct nk_arena *a, const void *p, size_t size)
+{
+    void *r = nk_arena_alloc_aligned(a, size, 1);
+    if (size) memcpy(r, p, size);
+    return r;
+}
@@ -0,0 +1,413 @@
+/* rngbench.cpp - PRNG throughput and statistical quality harness
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Measures the throughput of the ncmlib generators against a few common
+// alternatives, then runs a small offline battery of statistical tests
+// on each of them.  Exits with a nonzero status if any test p-value falls
+// outside [NK_BENCH_ALPHA, 1 - NK_BENCH_ALPHA], so it can be used to check
+// that an optimization has not changed output quality.
+//
+// Usage: rngbench [--bench-only | --stats-only] [--quick]
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <nk/tyche.hpp>
+extern "C" {
+#include <nk/random.h>
+#include <nk/random_tls.h>
+#include <nk/csprng.h>
+}
+
+#define NK_BENCH_ALPHA 1e-4
+
+namespace {
+
+// Reference generators for comparison.
+struct splitmix64 {
+    uint64_t x;
+    uint32_t operator()() noexcept {
+        uint64_t z = (x += 0x9e3779b97f4a7c15u);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+        return static_cast<uint32_t>((z ^ (z >> 31)) >> 32);
+    }
+};
+
+// Adapters that give every generator the same call syntax.  A bulk fill()
+// member is used by the bulk benchmark where the generator has one.
+struct nk_random_gen {
+    nk_random_state *s;
+    uint32_t operator()() noexcept { return nk_random_u32(s); }
+};
+struct nk_random_tls_gen {
+    uint32_t operator()() noexcept { return nk_random_tls_u32(); }
+};
+struct nk_csprng_gen {
+    nk_csprng *s;
+    uint32_t operator()() noexcept { return nk_csprng_u32(s); }
+    void fill(uint32_t *p, size_t n) noexcept { nk_csprng_get(s, p, n * sizeof *p); }
+};
+struct nk_csprng_tls_gen {
+    uint32_t operator()() noexcept { return nk_csprng_tls_u32(); }
+    void fill(uint32_t *p, size_t n) noexcept { nk_csprng_tls_get(p, n * sizeof *p); }
+};
+struct mt19937_gen {
+    std::mt19937 *m;
+    uint32_t operator()() noexcept { return static_cast<uint32_t>((*m)()); }
+};
+
+template <typename G, typename = void>
+struct has_fill : std::false_type {};
+template <typename G>
+struct has_fill<G, std::void_t<decltype(std::declval<G &>().fill(nullptr, 0))>>
+    : std::true_type {};
+
+// Throughput ------------------------------------------------------------
+
+volatile uint32_t sink;
+
+template <typename Fn>
+double time_ns(Fn &&fn)
+{
+    const auto t0 = std::chrono::steady_clock::now();
+    fn();
+    const auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(t1 - t0).count();
+}
+
+struct bench_result {
+    double t;  // ns for n single-word calls
+    double bt; // ns for n words in bulk
+};
+
+// Instantiated for each concrete generator type, so that the timed loops
+// call the generator directly rather than through type erasure.
+template <typename G>
+bench_result bench_one(G g, size_t n)
+{
+    std::vector<uint32_t> buf(4096);
+    bench_result r;
+    r.t = time_ns([&] {
+        uint32_t acc = 0;
+        for (size_t i = 0; i < n; ++i) acc ^= g();
+        sink = acc;
+    });
+    r.bt = time_ns([&] {
+        for (size_t i = 0; i < n; i += buf.size()) {
+            if constexpr (has_fill<G>::value) {
+                g.fill(buf.data(), buf.size());
+            } else {
+                for (auto &w : buf) w = g();
+            }
+            sink = buf[0];
+        }
+    });
+    return r;
+}
+
+// The type-erased form is used only to name the generators and by the
+// statistical tests, where call overhead does not matter.
+struct generator {
+    const char *name;
+    std::function<uint32_t()> next;
+    std::function<bench_result(size_t)> bench;
+};
+
+// g must outlive the returned generator; it is used by reference.
+template <typename G>
+generator make_generator(const char *name, G &g)
+{
+    return { name, [&g] { return g(); },
+             [&g](size_t n) { return bench_one<G &>(g, n); } };
+}
+
+std::vector<generator> make_generators()
+{
+    static nk_random_state crs;
+    static nk::rng::tyche ty;
+    static nk_csprng cs;
+    static std::mt19937 mt(12345);
+    static splitmix64 sm{12345};
+    nk_random_init(&crs);
+    nk_csprng_init(&cs);
+
+    static nk_random_gen crs_g{&crs};
+    static nk_random_tls_gen rtls_g;
+    static nk_csprng_gen cs_g{&cs};
+    static nk_csprng_tls_gen cstls_g;
+    static mt19937_gen mt_g{&mt};
+
+    std::vector<generator> g;
+    g.push_back(make_generator("nk_random_u32", crs_g));
+    g.push_back(make_generator("nk_random_tls_u32", rtls_g));
+    g.push_back(make_generator("nk::rng::tyche", ty));
+    g.push_back(make_generator("nk_csprng_u32", cs_g));
+    g.push_back(make_generator("nk_csprng_tls_u32", cstls_g));
+    g.push_back(make_generator("std::mt19937", mt_g));
+    g.push_back(make_generator("splitmix64", sm));
+    return g;
+}
+
+void run_bench(const std::vector<generator> &gens, bool quick)
+{
+    const size_t n = quick ? (1u << 22) : (1u << 26);
+    std::printf("%-20s %10s %10s %10s %10s\n", "generator", "ns/word", "GB/s",
+                "bulk ns/w", "bulk GB/s");
+    for (const auto &g : gens) {
+        const bench_result r = g.bench(n);
+        std::printf("%-20s %10.3f %10.3f %10.3f %10.3f\n", g.name, r.t / n,
+                    4.0 * n / r.t, r.bt / n, 4.0 * n / r.bt);
+    }
+}
+
+// Statistics ------------------------------------------------------------
+
+// Regularized upper incomplete gamma function Q(a, x).
+double igamc(double a, double x)
+{
+    if (x <= 0.0) return 1.0;
+    const double lg = std::lgamma(a);
+    if (x < a + 1.0) {
+        double ap = a, sum = 1.0 / a, del = sum;
+        for (int i = 0; i < 1000; ++i) {
+            del *= x / ++ap;
+            sum += del;
+            if (std::fabs(del) < std::fabs(sum) * 1e-15) break;
+        }
+        return 1.0 - sum * std::exp(-x + a * std::log(x) - lg);
+    }
+    double b = x + 1.0 - a, c = 1.0 / 1e-300, d = 1.0 / b, h = d;
+    for (int i = 1; i < 1000; ++i) {
+        const double an = -i * (i - a);
+        b += 2.0;
+        d = an * d + b;
+        if (std::fabs(d) < 1e-300) d = 1e-300;
+        c = b + an / c;
+        if (std::fabs(c) < 1e-300) c = 1e-300;
+        d = 1.0 / d;
+        const double del = d * c;
+        h *= del;
+        if (std::fabs(del - 1.0) < 1e-15) break;
+    }
+    return std::exp(-x + a * std::log(x) - lg) * h;
+}
+
+double chisq_p(const std::vector<double> &obs, const std::vector<double> &expect)
+{
+    double chi = 0.0;
+    for (size_t i = 0; i < obs.size(); ++i) {
+        const double d = obs[i] - expect[i];
+        chi += d * d / expect[i];
+    }
+    return igamc((obs.size() - 1) / 2.0, chi / 2.0);
+}
+
+// Proportion of one bits.
+double test_frequency(const generator &g, size_t words)
+{
+    uint64_t ones = 0;
+    for (size_t i = 0; i < words; ++i) ones += __builtin_popcount(g.next());
+    const double n = 32.0 * words;
+    const double z = (ones - n / 2.0) / std::sqrt(n / 4.0);
+    return std::erfc(std::fabs(z) / std::sqrt(2.0));
+}
+
+// Knuth's gap test on [0, 1/2): the lengths of runs between hits should be
+// geometrically distributed.
+double test_gap(const generator &g, size_t gaps)
+{
+    const size_t t = 16;
+    std::vector<double> obs(t + 1, 0.0), expect(t + 1);
+    for (size_t found = 0; found < gaps; ++found) {
+        size_t len = 0;
+        while (g.next() >= 0x80000000u) ++len;
+        ++obs[std::min(len, t)];
+    }
+    for (size_t k = 0; k < t; ++k) expect[k] = gaps * std::ldexp(1.0, -(int)k - 1);
+    expect[t] = gaps * std::ldexp(1.0, -(int)t);
+    return chisq_p(obs, expect);
+}
+
+// Marsaglia's birthday spacings: 512 birthdays in a year of 2^24 days; the
+// number of repeated spacings is Poisson with lambda = m^3 / 4n = 2.
+double test_birthday(const generator &g, size_t reps)
+{
+    const size_t m = 512, cats = 6;
+    std::vector<uint32_t> b(m), s(m);
+    std::vector<double> obs(cats, 0.0), expect(cats);
+    for (size_t r = 0; r < reps; ++r) {
+        for (auto &x : b) x = g.next() >> 8;
+        std::sort(b.begin(), b.end());
+        s[0] = b[0];
+        for (size_t i = 1; i < m; ++i) s[i] = b[i] - b[i - 1];
+        std::sort(s.begin(), s.end());
+        size_t j = 0;
+        for (size_t i = 1; i < m; ++i) j += s[i] == s[i - 1];
+        ++obs[std::min(j, cats - 1)];
+    }
+    double p = std::exp(-2.0), tail = 1.0;
+    for (size_t k = 0; k < cats - 1; ++k) {
+        expect[k] = reps * p;
+        tail -= p;
+        p *= 2.0 / (k + 1);
+    }
+    expect[cats - 1] = reps * tail;
+    return chisq_p(obs, expect);
+}
+
+// Rank over GF(2) of 32x32 bit matrices.
+double test_matrix_rank(const generator &g, size_t mats)
+{
+    std::vector<double> obs(3, 0.0);
+    uint32_t row[32];
+    for (size_t n = 0; n < mats; ++n) {
+        for (auto &r : row) r = g.next();
+        int rank = 0;
+        for (int bit = 31; bit >= 0 && rank < 32; --bit) {
+            const uint32_t mask = 1u << bit;
+            int piv = -1;
+            for (int i = rank; i < 32; ++i)
+                if (row[i] & mask) { piv = i; break; }
+            if (piv < 0) continue;
+            std::swap(row[rank], row[piv]);
+            for (int i = 0; i < 32; ++i)
+                if (i != rank && (row[i] & mask)) row[i] ^= row[rank];
+            ++rank;
+        }
+        ++obs[rank == 32 ? 0 : rank == 31 ? 1 : 2];
+    }
+    const std::vector<double> expect{ mats * 0.2887880950866,
+                                      mats * 0.5775761901732,
+                                      mats * 0.1336357147402 };
+    return chisq_p(obs, expect);
+}
+
+// NIST SP 800-22 linear complexity test, via Berlekamp-Massey on blocks of
+// M bits.
+double test_linear_complexity(const generator &g, size_t blocks)
+{
+    const int M = 500;
+    const double mu = M / 2.0 + (9.0 + ((M + 1) % 2 ? -1.0 : 1.0)) / 36.0
+                      - (M / 3.0 + 2.0 / 9.0) / std::ldexp(1.0, M);
+    static const double pi[7] = { 0.010417, 0.03125, 0.125, 0.5, 0.25,
+                                  0.0625, 0.020833 };
+    std::vector<double> obs(7, 0.0), expect(7);
+    std::vector<uint8_t> s(M), c(M), b(M), t(M);
+    for (size_t n = 0; n < blocks; ++n) {
+        uint32_t w = 0;
+        for (int i = 0; i < M; ++i) {
+            if (i % 32 == 0) w = g.next();
+            s[i] = (w >> (i % 32)) & 1;
+        }
+        std::fill(c.begin(), c.end(), 0);
+        std::fill(b.begin(), b.end(), 0);
+        c[0] = b[0] = 1;
+        int L = 0, m = -1;
+        for (int i = 0; i < M; ++i) {
+            uint8_t d = s[i];
+            for (int j = 1; j <= L; ++j) d ^= c[j] & s[i - j];
+            if (!d) continue;
+            t = c;
+            for (int j = 0; j + i - m < M; ++j) c[j + i - m] ^= b[j];
+            if (L <= i / 2) {
+                L = i + 1 - L;
+                m = i;
+                b = t;
+            }
+        }
+        const double T = (M % 2 ? -1.0 : 1.0) * (L - mu) + 2.0 / 9.0;
+        const size_t bin = T <= -2.5 ? 0 : T <= -1.5 ? 1 : T <= -0.5 ? 2 :
+                           T <= 0.5 ? 3 : T <= 1.5 ? 4 : T <= 2.5 ? 5 : 6;
+        ++obs[bin];
+    }
+    for (size_t i = 0; i < 7; ++i) expect[i] = blocks * pi[i];
+    return chisq_p(obs, expect);
+}
+
+bool run_stats(const std::vector<generator> &gens, bool quick)
+{
+    const size_t scale = quick ? 1 : 8;
+    struct test {
+        const char *name;
+        std::function<double(const generator &)> fn;
+    };
+    const test tests[] = {
+        { "frequency", [=](const generator &g) { return test_frequency(g, scale << 20); } },
+        { "gap", [=](const generator &g) { return test_gap(g, scale << 18); } },
+        { "birthday", [=](const generator &g) { return test_birthday(g, scale * 1000); } },
+        { "rank", [=](const generator &g) { return test_matrix_rank(g, scale * 10000); } },
+        { "lincomp", [=](const generator &g) { return test_linear_complexity(g, scale * 500); } },
+    };
+    bool ok = true;
+    std::printf("\n%-20s", "p-values");
+    for (const auto &t : tests) std::printf(" %10s", t.name);
+    std::printf("\n");
+    for (const auto &g : gens) {
+        std::printf("%-20s", g.name);
+        for (const auto &t : tests) {
+            const double p = t.fn(g);
+            const bool fail = p < NK_BENCH_ALPHA || p > 1.0 - NK_BENCH_ALPHA;
+            std::printf(" %9.6f%c", p, fail ? '!' : ' ');
+            ok = ok && !fail;
+        }
+        std::printf("\n");
+    }
+    return ok;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    bool bench = true, stats = true, quick = false;
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "--bench-only")) stats = false;
+        else if (!std::strcmp(argv[i], "--stats-only")) bench = false;
+        else if (!std::strcmp(argv[i], "--quick")) quick = true;
+        else {
+            std::fprintf(stderr, "usage: %s [--bench-only | --stats-only] [--quick]\n", argv[0]);
+            return 2;
+        }
+    }
+    const auto gens = make_generators();
+    if (bench) run_bench(gens, quick);
+    if (stats && !run_stats(gens, quick)) {
+        std::printf("\nFAIL: p-value outside [%g, %g]\n", NK_BENCH_ALPHA, 1.0 - NK_BENCH_ALPHA);
+        return 1;
+    }
+    return 0;
+}
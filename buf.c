@@ -0,0 +1,107 @@
+/* buf.c - growable byte buffer with headroom
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nk/buf.h"
+#include "nk/io.h"
+#include "nk/malloc.h"
+#include "nk/log.h"
+
+void nk_buf_init(struct nk_buf *b, size_t headroom)
+{
+    b->heap = NULL;
+    b->head = headroom;
+    b->len = 0;
+    b->cap = NK_BUF_INLINE;
+    b->headroom = headroom;
+    if (headroom > NK_BUF_INLINE / 2) {
+        if (headroom > SIZE_MAX / 2 - NK_BUF_INLINE)
+            suicide("%s: headroom %zu is too large", __func__, headroom);
+        b->cap = 2 * headroom + NK_BUF_INLINE;
+        b->heap = xmalloc(b->cap);
+    }
+}
+
+void nk_buf_destroy(struct nk_buf *b)
+{
+    free(b->heap);
+    nk_buf_init(b, 0);
+}
+
+// Rearranges storage so that there are at least front bytes of headroom
+// beyond the configured amount and at least back bytes of tailroom.
+// Space freed by nk_buf_consume() is reclaimed by moving the contents
+// down only when the result fits in half the storage; otherwise storage
+// is doubled.  Extra headroom is at least the length of the contents, so
+// that a run of prepends moves them only O(log n) times.  Either way the
+// cost is amortized over the bytes added since the last call.
+void nk_buf_grow(struct nk_buf *b, size_t front, size_t back)
+{
+    if (front && front < b->len)
+        front = b->len;
+    size_t head = b->headroom + front;
+    if (head < front || b->len > SIZE_MAX - head || back > SIZE_MAX - head - b->len)
+        suicide("%s: size is too large", __func__);
+    size_t need = head + b->len + back;
+
+    char *old = nk_buf_storage(b);
+    if (need <= b->cap / 2 || (!b->heap && need <= b->cap)) {
+        memmove(old + head, old + b->head, b->len);
+        b->head = head;
+        return;
+    }
+    size_t cap = b->cap <= SIZE_MAX / 2 ? b->cap * 2 : SIZE_MAX;
+    if (cap < need)
+        cap = need;
+    char *n = xmalloc(cap);
+    memcpy(n + head, old + b->head, b->len);
+    free(b->heap);
+    b->heap = n;
+    b->head = head;
+    b->cap = cap;
+}
+
+// Reads up to len bytes from fd and appends them.  Returns as safe_read().
+ssize_t nk_buf_read(struct nk_buf *b, int fd, size_t len)
+{
+    ssize_t r = safe_read(fd, nk_buf_reserve(b, len), len);
+    if (r > 0)
+        b->len += (size_t)r;
+    return r;
+}
+
+// Receives up to len bytes from fd and appends them.  Returns as safe_recv().
+ssize_t nk_buf_recv(struct nk_buf *b, int fd, size_t len, int flags)
+{
+    ssize_t r = safe_recv(fd, nk_buf_reserve(b, len), len, flags);
+    if (r > 0)
+        b->len += (size_t)r;
+    return r;
+}
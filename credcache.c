@@ -0,0 +1,545 @@
+/* credcache.c - cached passwd and group lookups
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "nk/credcache.h"
+#include "nk/credfile.h"
+#include "nk/malloc.h"
+#include "nk/log.h"
+
+struct nk_cred_stamp {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtim;
+};
+
+// Immutable once published.  Hash tables hold an index + 1 into users or
+// groups, or 0 for an empty slot.  If file is set, lookups are answered by
+// it instead of the tables.
+struct nk_credsnap {
+    struct nk_credsnap *older;
+    uint64_t retired; // when it was replaced, as nk_cred_now()
+    struct nk_credfile *file;
+    struct nk_cred_stamp stamp[2];
+    const struct nk_cred_user *users;
+    const struct nk_cred_group *groups;
+    const uint32_t *by_uid, *by_uname, *by_gid, *by_gname;
+    uint32_t umask, gmask;
+};
+
+// Replaced snapshots are freed this many seconds after replacement.
+#define NK_CRED_GRACE 60
+
+static struct nk_credsnap *nk_cred_cur;
+// Second of the last check of the files, plus one; zero if none yet.
+static uint64_t nk_cred_checked;
+static pthread_mutex_t nk_cred_lock = PTHREAD_MUTEX_INITIALIZER;
+// Written with nk_cred_lock held.
+static char nk_cred_path[2][PATH_MAX] = { "/etc/passwd", "/etc/group" };
+static bool nk_cred_files;
+
+static inline uint32_t nk_cred_hash_id(uint32_t x)
+{
+    x *= 0x9e3779b1u;
+    return x ^ (x >> 16);
+}
+
+static inline uint32_t nk_cred_hash_str(const char *s)
+{
+    uint32_t h = 2166136261u;
+    for (; *s; ++s) h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+
+static void nk_cred_stat(struct nk_cred_stamp *st, const char *path)
+{
+    struct stat s;
+    memset(st, 0, sizeof *st);
+    if (stat(path, &s))
+        return;
+    st->dev = s.st_dev;
+    st->ino = s.st_ino;
+    st->size = s.st_size;
+    st->mtim = s.st_mtim;
+}
+
+static bool nk_cred_stamp_eq(const struct nk_cred_stamp *a,
+                             const struct nk_cred_stamp *b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size
+        && a->mtim.tv_sec == b->mtim.tv_sec
+        && a->mtim.tv_nsec == b->mtim.tv_nsec;
+}
+
+// While building, string fields hold offsets into str.
+struct nk_cred_build {
+    struct nk_cred_user *users;
+    struct nk_cred_group *groups;
+    char *str;
+    size_t nusers, ucap, ngroups, gcap, slen, scap;
+};
+
+static const char *nk_cred_addstr(struct nk_cred_build *b, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    if (b->slen + len > b->scap) {
+        while (b->slen + len > b->scap) b->scap = b->scap ? b->scap * 2 : 4096;
+        b->str = xrealloc(b->str, b->scap);
+    }
+    memcpy(b->str + b->slen, s, len);
+    const char *off = (const char *)(uintptr_t)b->slen;
+    b->slen += len;
+    return off;
+}
+
+static int nk_cred_enum_users(struct nk_cred_build *b)
+{
+    size_t buflen = 1024;
+    char *buf = xmalloc(buflen);
+    struct passwd pw, *pwp;
+    int ret = 0;
+    setpwent();
+    for (;;) {
+        int r = getpwent_r(&pw, buf, buflen, &pwp);
+        if (r == ERANGE) {
+            buflen *= 2;
+            buf = xrealloc(buf, buflen);
+            continue;
+        }
+        if (r == ENOENT || (!r && !pwp))
+            break;
+        if (r) {
+            ret = r;
+            break;
+        }
+        if (b->nusers == b->ucap) {
+            b->ucap = b->ucap ? b->ucap * 2 : 64;
+            b->users = xrealloc(b->users, b->ucap * sizeof *b->users);
+        }
+        b->users[b->nusers++] = (struct nk_cred_user){
+            .name = nk_cred_addstr(b, pw.pw_name),
+            .dir = nk_cred_addstr(b, pw.pw_dir ? pw.pw_dir : ""),
+            .shell = nk_cred_addstr(b, pw.pw_shell ? pw.pw_shell : ""),
+            .uid = pw.pw_uid,
+            .gid = pw.pw_gid,
+        };
+    }
+    endpwent();
+    free(buf);
+    return ret;
+}
+
+static int nk_cred_enum_groups(struct nk_cred_build *b)
+{
+    size_t buflen = 1024;
+    char *buf = xmalloc(buflen);
+    struct group gr, *grp;
+    int ret = 0;
+    setgrent();
+    for (;;) {
+        int r = getgrent_r(&gr, buf, buflen, &grp);
+        if (r == ERANGE) {
+            buflen *= 2;
+            buf = xrealloc(buf, buflen);
+            continue;
+        }
+        if (r == ENOENT || (!r && !grp))
+            break;
+        if (r) {
+            ret = r;
+            break;
+        }
+        if (b->ngroups == b->gcap) {
+            b->gcap = b->gcap ? b->gcap * 2 : 64;
+            b->groups = xrealloc(b->groups, b->gcap * sizeof *b->groups);
+        }
+        b->groups[b->ngroups++] = (struct nk_cred_group){
+            .name = nk_cred_addstr(b, gr.gr_name),
+            .gid = gr.gr_gid,
+        };
+    }
+    endgrent();
+    free(buf);
+    return ret;
+}
+
+static uint32_t nk_cred_mask(size_t n)
+{
+    size_t sz = 8;
+    while (sz < n * 2) sz *= 2;
+    return (uint32_t)sz - 1;
+}
+
+// The first entry for a key wins, as it would with getpwuid() etc.
+static void nk_cred_index_id(uint32_t *t, uint32_t mask, uint32_t id,
+                             uint32_t idx, const void *base, size_t stride,
+                             size_t idoff)
+{
+    for (uint32_t h = nk_cred_hash_id(id) & mask;; h = (h + 1) & mask) {
+        if (!t[h]) {
+            t[h] = idx + 1;
+            return;
+        }
+        uint32_t oid;
+        memcpy(&oid, (const char *)base + (t[h] - 1) * stride + idoff, sizeof oid);
+        if (oid == id)
+            return;
+    }
+}
+
+static void nk_cred_index_name(uint32_t *t, uint32_t mask, const char *name,
+                               uint32_t idx, const void *base, size_t stride)
+{
+    for (uint32_t h = nk_cred_hash_str(name) & mask;; h = (h + 1) & mask) {
+        if (!t[h]) {
+            t[h] = idx + 1;
+            return;
+        }
+        const char *oname;
+        memcpy(&oname, (const char *)base + (t[h] - 1) * stride, sizeof oname);
+        if (!strcmp(oname, name))
+            return;
+    }
+}
+
+static struct nk_credsnap *nk_cred_build(int *err)
+{
+    struct nk_cred_build b = {0};
+    struct nk_cred_stamp st[2];
+    nk_cred_stat(&st[0], nk_cred_path[0]);
+    nk_cred_stat(&st[1], nk_cred_path[1]);
+    if (nk_cred_files) {
+        struct nk_credfile *f;
+        *err = nk_credfile_open(&f, nk_cred_path[0], nk_cred_path[1]);
+        if (*err)
+            return NULL;
+        struct nk_credsnap *s = xmalloc(sizeof *s);
+        *s = (struct nk_credsnap){ .file = f, .stamp = { st[0], st[1] } };
+        return s;
+    }
+    *err = nk_cred_enum_users(&b);
+    if (!*err)
+        *err = nk_cred_enum_groups(&b);
+    if (*err || b.nusers > UINT32_MAX / 4 || b.ngroups > UINT32_MAX / 4) {
+        if (!*err) *err = EOVERFLOW;
+        free(b.users);
+        free(b.groups);
+        free(b.str);
+        return NULL;
+    }
+
+    // One allocation: header, entries, hash tables, then strings.
+    uint32_t umask = nk_cred_mask(b.nusers), gmask = nk_cred_mask(b.ngroups);
+    size_t usz = b.nusers * sizeof *b.users, gsz = b.ngroups * sizeof *b.groups;
+    size_t utsz = ((size_t)umask + 1) * sizeof(uint32_t);
+    size_t gtsz = ((size_t)gmask + 1) * sizeof(uint32_t);
+    char *p = xmalloc(sizeof(struct nk_credsnap) + usz + gsz + 2 * utsz
+                      + 2 * gtsz + b.slen);
+    struct nk_credsnap *s = (struct nk_credsnap *)p;
+    struct nk_cred_user *users = (struct nk_cred_user *)(p + sizeof *s);
+    struct nk_cred_group *groups = (struct nk_cred_group *)((char *)users + usz);
+    uint32_t *by_uid = (uint32_t *)((char *)groups + gsz);
+    uint32_t *by_uname = (uint32_t *)((char *)by_uid + utsz);
+    uint32_t *by_gid = (uint32_t *)((char *)by_uname + utsz);
+    uint32_t *by_gname = (uint32_t *)((char *)by_gid + gtsz);
+    char *str = (char *)by_gname + gtsz;
+    if (b.slen) memcpy(str, b.str, b.slen);
+    memset(by_uid, 0, 2 * utsz + 2 * gtsz);
+
+    for (size_t i = 0; i < b.nusers; ++i) {
+        users[i] = b.users[i];
+        users[i].name = str + (uintptr_t)b.users[i].name;
+        users[i].dir = str + (uintptr_t)b.users[i].dir;
+        users[i].shell = str + (uintptr_t)b.users[i].shell;
+        nk_cred_index_id(by_uid, umask, users[i].uid, (uint32_t)i, users,
+                         sizeof *users, offsetof(struct nk_cred_user, uid));
+        nk_cred_index_name(by_uname, umask, users[i].name, (uint32_t)i,
+                           users, sizeof *users);
+    }
+    for (size_t i = 0; i < b.ngroups; ++i) {
+        groups[i] = b.groups[i];
+        groups[i].name = str + (uintptr_t)b.groups[i].name;
+        nk_cred_index_id(by_gid, gmask, groups[i].gid, (uint32_t)i, groups,
+                         sizeof *groups, offsetof(struct nk_cred_group, gid));
+        nk_cred_index_name(by_gname, gmask, groups[i].name, (uint32_t)i,
+                           groups, sizeof *groups);
+    }
+    free(b.users);
+    free(b.groups);
+    free(b.str);
+
+    *s = (struct nk_credsnap){
+        .stamp = { st[0], st[1] },
+        .users = users, .groups = groups,
+        .by_uid = by_uid, .by_uname = by_uname,
+        .by_gid = by_gid, .by_gname = by_gname,
+        .umask = umask, .gmask = gmask,
+    };
+    return s;
+}
+
+// A child forked while another thread held nk_cred_lock would otherwise
+// deadlock on its first reload, so fork() waits for the lock.
+static void nk_cred_atfork_prepare(void)
+{
+    pthread_mutex_lock(&nk_cred_lock);
+}
+
+static void nk_cred_atfork_release(void)
+{
+    pthread_mutex_unlock(&nk_cred_lock);
+}
+
+static void nk_cred_init(void)
+{
+    if (pthread_atfork(nk_cred_atfork_prepare, nk_cred_atfork_release,
+                       nk_cred_atfork_release))
+        suicide("%s: pthread_atfork failed", __func__);
+}
+
+static void nk_cred_lock_acquire(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, nk_cred_init);
+    pthread_mutex_lock(&nk_cred_lock);
+}
+
+static uint64_t nk_cred_now(void)
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec;
+}
+
+static void nk_cred_free_chain(struct nk_credsnap *s)
+{
+    while (s) {
+        struct nk_credsnap *o = s->older;
+        nk_credfile_close(s->file);
+        free(s);
+        s = o;
+    }
+}
+
+// Replaces the current snapshot if there is none or if force is set or
+// the files have changed.  Must be called with nk_cred_lock held.
+static int nk_cred_reload_locked(bool force)
+{
+    struct nk_credsnap *cur = __atomic_load_n(&nk_cred_cur, __ATOMIC_ACQUIRE);
+    if (cur && !force) {
+        struct nk_cred_stamp st[2];
+        nk_cred_stat(&st[0], nk_cred_path[0]);
+        nk_cred_stat(&st[1], nk_cred_path[1]);
+        if (nk_cred_stamp_eq(&st[0], &cur->stamp[0])
+            && nk_cred_stamp_eq(&st[1], &cur->stamp[1]))
+            return 0;
+    }
+    int err;
+    struct nk_credsnap *s = nk_cred_build(&err);
+    if (!s)
+        return err;
+    const uint64_t now = nk_cred_now();
+    if (cur)
+        cur->retired = now;
+    s->older = cur;
+    __atomic_store_n(&nk_cred_checked, now + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&nk_cred_cur, s, __ATOMIC_RELEASE);
+    // Snapshots are retired newest first, so everything past the first
+    // one that has outlived the grace period has too.
+    for (struct nk_credsnap **o = &s->older; *o; o = &(*o)->older) {
+        if (now - (*o)->retired >= NK_CRED_GRACE) {
+            nk_cred_free_chain(*o);
+            *o = NULL;
+            break;
+        }
+    }
+    return 0;
+}
+
+static const struct nk_credsnap *nk_cred_get(void)
+{
+    struct nk_credsnap *s = __atomic_load_n(&nk_cred_cur, __ATOMIC_ACQUIRE);
+    uint64_t now = nk_cred_now() + 1;
+    uint64_t last = __atomic_load_n(&nk_cred_checked, __ATOMIC_RELAXED);
+    // Only one caller per second pays for the stat() calls, or for another
+    // attempt at a load that failed.
+    if (now == last
+        || !__atomic_compare_exchange_n(&nk_cred_checked, &last, now, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return s;
+    nk_cred_lock_acquire();
+    nk_cred_reload_locked(false);
+    pthread_mutex_unlock(&nk_cred_lock);
+    return __atomic_load_n(&nk_cred_cur, __ATOMIC_ACQUIRE);
+}
+
+// Loads the databases now, replacing any cached copy.  Returns 0 or an
+// errno value, in which case the previous snapshot (if any) is kept.
+int nk_credcache_load(void)
+{
+    nk_cred_lock_acquire();
+    int r = nk_cred_reload_locked(true);
+    pthread_mutex_unlock(&nk_cred_lock);
+    return r;
+}
+
+// Frees every snapshot.  No lookups may be in progress, and no entries
+// returned by earlier lookups may be used afterwards.
+void nk_credcache_free(void)
+{
+    nk_cred_lock_acquire();
+    struct nk_credsnap *s = __atomic_exchange_n(&nk_cred_cur, NULL,
+                                                __ATOMIC_ACQ_REL);
+    nk_cred_free_chain(s);
+    pthread_mutex_unlock(&nk_cred_lock);
+}
+
+/*
+ * Switches the cache to reading root/etc/passwd and root/etc/group with
+ * nk_credfile instead of enumerating NSS, and loads them.  root may be
+ * NULL for "/".  Once set, the cache holds every entry there is, so
+ * callers need not fall back to NSS on a miss; see
+ * nk_credcache_files_only().  Returns 0 or an errno value, in which case
+ * the previous source and snapshot are kept.
+ */
+int nk_credcache_use_files(const char *root)
+{
+    char path[2][PATH_MAX];
+    if (!root) root = "";
+    int n0 = snprintf(path[0], sizeof path[0], "%s/etc/passwd", root);
+    int n1 = snprintf(path[1], sizeof path[1], "%s/etc/group", root);
+    if (n0 < 0 || n1 < 0 || (size_t)n0 >= sizeof path[0]
+        || (size_t)n1 >= sizeof path[1])
+        return ENAMETOOLONG;
+    nk_cred_lock_acquire();
+    // The build reads the paths and mode, so they are switched first and
+    // put back if the files cannot be loaded.
+    char oldpath[2][PATH_MAX];
+    const bool oldfiles = nk_cred_files;
+    memcpy(oldpath, nk_cred_path, sizeof oldpath);
+    memcpy(nk_cred_path, path, sizeof path);
+    __atomic_store_n(&nk_cred_files, true, __ATOMIC_RELAXED);
+    int r = nk_cred_reload_locked(true);
+    if (r) {
+        memcpy(nk_cred_path, oldpath, sizeof oldpath);
+        __atomic_store_n(&nk_cred_files, oldfiles, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&nk_cred_lock);
+    return r;
+}
+
+bool nk_credcache_files_only(void)
+{
+    return __atomic_load_n(&nk_cred_files, __ATOMIC_RELAXED);
+}
+
+const struct nk_cred_user *nk_cred_user_byuid(uid_t uid)
+{
+    const struct nk_credsnap *s = nk_cred_get();
+    if (!s)
+        return NULL;
+    if (s->file)
+        return nk_credfile_user_byuid(s->file, uid);
+    for (uint32_t h = nk_cred_hash_id(uid) & s->umask;; h = (h + 1) & s->umask) {
+        uint32_t i = s->by_uid[h];
+        if (!i)
+            return NULL;
+        if (s->users[i - 1].uid == uid)
+            return &s->users[i - 1];
+    }
+}
+
+const struct nk_cred_user *nk_cred_user_byname(const char *name)
+{
+    const struct nk_credsnap *s = nk_cred_get();
+    if (!s)
+        return NULL;
+    if (s->file)
+        return nk_credfile_user_byname(s->file, name);
+    for (uint32_t h = nk_cred_hash_str(name) & s->umask;; h = (h + 1) & s->umask) {
+        uint32_t i = s->by_uname[h];
+        if (!i)
+            return NULL;
+        if (!strcmp(s->users[i - 1].name, name))
+            return &s->users[i - 1];
+    }
+}
+
+const struct nk_cred_group *nk_cred_group_bygid(gid_t gid)
+{
+    const struct nk_credsnap *s = nk_cred_get();
+    if (!s)
+        return NULL;
+    if (s->file)
+        return nk_credfile_group_bygid(s->file, gid);
+    for (uint32_t h = nk_cred_hash_id(gid) & s->gmask;; h = (h + 1) & s->gmask) {
+        uint32_t i = s->by_gid[h];
+        if (!i)
+            return NULL;
+        if (s->groups[i - 1].gid == gid)
+            return &s->groups[i - 1];
+    }
+}
+
+const struct nk_cred_group *nk_cred_group_byname(const char *name)
+{
+    const struct nk_credsnap *s = nk_cred_get();
+    if (!s)
+        return NULL;
+    if (s->file)
+        return nk_credfile_group_byname(s->file, name);
+    for (uint32_t h = nk_cred_hash_str(name) & s->gmask;; h = (h + 1) & s->gmask) {
+        uint32_t i = s->by_gname[h];
+        if (!i)
+            return NULL;
+        if (!strcmp(s->groups[i - 1].name, name))
+            return &s->groups[i - 1];
+    }
+}
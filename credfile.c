@@ -0,0 +1,325 @@
+/* credfile.c - passwd and group file index without NSS
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "nk/credfile.h"
+#include "nk/malloc.h"
+
+struct nk_credmap {
+    char *p;
+    size_t len;
+};
+
+struct nk_credfile {
+    struct nk_credmap pmap, gmap;
+    struct nk_cred_user *users;         // sorted by uid
+    const struct nk_cred_user **unames; // sorted by name
+    struct nk_cred_group *groups;       // sorted by gid
+    const struct nk_cred_group **gnames; // sorted by name
+    size_t nusers, ngroups, ucap, gcap;
+};
+
+// Maps path privately and writably with one extra byte past the end, so
+// that the last line can be NUL-terminated in place even if it lacks a
+// newline.  The file is reserved with an anonymous mapping first: if its
+// size is a multiple of the page size, the extra byte lands there.
+static int nk_credfile_map(struct nk_credmap *m, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+    struct stat st;
+    if (fstat(fd, &st)) {
+        int e = errno;
+        close(fd);
+        return e;
+    }
+    size_t len = (size_t)st.st_size;
+    char *p = mmap(NULL, len + 1, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        int e = errno;
+        close(fd);
+        return e;
+    }
+    if (len && mmap(p, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                    fd, 0) == MAP_FAILED) {
+        int e = errno;
+        munmap(p, len + 1);
+        close(fd);
+        return e;
+    }
+    close(fd);
+    p[len] = 0;
+    m->p = p;
+    m->len = len;
+    return 0;
+}
+
+static void nk_credfile_unmap(struct nk_credmap *m)
+{
+    if (m->p)
+        munmap(m->p, m->len + 1);
+    m->p = NULL;
+}
+
+// Splits [p, end) at ':' into at most n fields, NUL-terminating each in
+// place.  Returns the number of fields.
+static size_t nk_credfile_split(char *p, char *end, char **f, size_t n)
+{
+    for (size_t k = 0;;) {
+        f[k++] = p;
+        char *c = k < n ? memchr(p, ':', (size_t)(end - p)) : NULL;
+        if (!c) {
+            *end = 0;
+            return k;
+        }
+        *c = 0;
+        p = c + 1;
+    }
+}
+
+static bool nk_credfile_id(const char *s, uint32_t *id)
+{
+    uint64_t v = 0;
+    if (!*s)
+        return false;
+    for (; *s; ++s) {
+        if (*s < '0' || *s > '9')
+            return false;
+        v = v * 10 + (uint64_t)(*s - '0');
+        if (v >= UINT32_MAX)
+            return false;
+    }
+    *id = (uint32_t)v;
+    return true;
+}
+
+// Calls fn for each entry line of m, split into at most nf fields.  Lines
+// are found with memchr(), which libc vectorizes.
+static void nk_credfile_lines(struct nk_credmap *m, size_t nf,
+                              void (*fn)(void *, char **, size_t), void *arg)
+{
+    char *f[7];
+    char *e = m->p + m->len;
+    for (char *p = m->p, *next; p < e; p = next) {
+        char *end = memchr(p, '\n', (size_t)(e - p));
+        if (!end)
+            end = e;
+        next = end + 1;
+        if (p == end || *p == '#' || *p == '+' || *p == '-')
+            continue;
+        fn(arg, f, nk_credfile_split(p, end, f, nf));
+    }
+}
+
+static void nk_credfile_add_user(void *arg, char **f, size_t nf)
+{
+    struct nk_credfile *cf = arg;
+    uint32_t uid, gid;
+    if (nf != 7 || !*f[0] || !nk_credfile_id(f[2], &uid)
+        || !nk_credfile_id(f[3], &gid))
+        return;
+    if (cf->nusers == cf->ucap) {
+        cf->ucap = cf->ucap ? cf->ucap * 2 : 64;
+        cf->users = xrealloc(cf->users, cf->ucap * sizeof *cf->users);
+    }
+    cf->users[cf->nusers++] = (struct nk_cred_user){
+        .name = f[0], .dir = f[5], .shell = f[6], .uid = uid, .gid = gid,
+    };
+}
+
+static void nk_credfile_add_group(void *arg, char **f, size_t nf)
+{
+    struct nk_credfile *cf = arg;
+    uint32_t gid;
+    if (nf != 4 || !*f[0] || !nk_credfile_id(f[2], &gid))
+        return;
+    if (cf->ngroups == cf->gcap) {
+        cf->gcap = cf->gcap ? cf->gcap * 2 : 64;
+        cf->groups = xrealloc(cf->groups, cf->gcap * sizeof *cf->groups);
+    }
+    cf->groups[cf->ngroups++] = (struct nk_cred_group){
+        .name = f[0], .gid = gid,
+    };
+}
+
+// Name strings lie in file order within the mapping, so comparing their
+// addresses breaks ties in favour of the first entry in the file.
+static int nk_credfile_cmp_order(const char *a, const char *b)
+{
+    return (a > b) - (a < b);
+}
+
+static int nk_credfile_cmp_uid(const void *x, const void *y)
+{
+    const struct nk_cred_user *a = x, *b = y;
+    if (a->uid != b->uid)
+        return a->uid < b->uid ? -1 : 1;
+    return nk_credfile_cmp_order(a->name, b->name);
+}
+
+static int nk_credfile_cmp_uname(const void *x, const void *y)
+{
+    const struct nk_cred_user *a = *(const struct nk_cred_user * const *)x;
+    const struct nk_cred_user *b = *(const struct nk_cred_user * const *)y;
+    int r = strcmp(a->name, b->name);
+    return r ? r : nk_credfile_cmp_order(a->name, b->name);
+}
+
+static int nk_credfile_cmp_gid(const void *x, const void *y)
+{
+    const struct nk_cred_group *a = x, *b = y;
+    if (a->gid != b->gid)
+        return a->gid < b->gid ? -1 : 1;
+    return nk_credfile_cmp_order(a->name, b->name);
+}
+
+static int nk_credfile_cmp_gname(const void *x, const void *y)
+{
+    const struct nk_cred_group *a = *(const struct nk_cred_group * const *)x;
+    const struct nk_cred_group *b = *(const struct nk_cred_group * const *)y;
+    int r = strcmp(a->name, b->name);
+    return r ? r : nk_credfile_cmp_order(a->name, b->name);
+}
+
+/*
+ * Opens and indexes the given passwd and group files; either path may be
+ * NULL to skip it.  The files should be replaced by rename() rather than
+ * rewritten in place while open, as is done by the shadow utilities.
+ *
+ * Returns 0 and sets *cf, or an errno value.
+ */
+int nk_credfile_open(struct nk_credfile **cf, const char *passwd_path,
+                     const char *group_path)
+{
+    struct nk_credfile *c = xmalloc(sizeof *c);
+    memset(c, 0, sizeof *c);
+    int r;
+    if (passwd_path && (r = nk_credfile_map(&c->pmap, passwd_path)))
+        goto err;
+    if (group_path && (r = nk_credfile_map(&c->gmap, group_path)))
+        goto err;
+    if (c->pmap.p)
+        nk_credfile_lines(&c->pmap, 7, nk_credfile_add_user, c);
+    if (c->gmap.p)
+        nk_credfile_lines(&c->gmap, 4, nk_credfile_add_group, c);
+
+    qsort(c->users, c->nusers, sizeof *c->users, nk_credfile_cmp_uid);
+    qsort(c->groups, c->ngroups, sizeof *c->groups, nk_credfile_cmp_gid);
+    c->unames = xmalloc((c->nusers + 1) * sizeof *c->unames);
+    c->gnames = xmalloc((c->ngroups + 1) * sizeof *c->gnames);
+    for (size_t i = 0; i < c->nusers; ++i) c->unames[i] = &c->users[i];
+    for (size_t i = 0; i < c->ngroups; ++i) c->gnames[i] = &c->groups[i];
+    qsort(c->unames, c->nusers, sizeof *c->unames, nk_credfile_cmp_uname);
+    qsort(c->gnames, c->ngroups, sizeof *c->gnames, nk_credfile_cmp_gname);
+    *cf = c;
+    return 0;
+err:
+    nk_credfile_close(c);
+    return r;
+}
+
+void nk_credfile_close(struct nk_credfile *cf)
+{
+    if (!cf)
+        return;
+    nk_credfile_unmap(&cf->pmap);
+    nk_credfile_unmap(&cf->gmap);
+    free(cf->users);
+    free(cf->unames);
+    free(cf->groups);
+    free(cf->gnames);
+    free(cf);
+}
+
+// The searches below find the first element that is not less than the key,
+// which is the first entry in the file for that key.
+
+const struct nk_cred_user *nk_credfile_user_byuid(const struct nk_credfile *cf,
+                                                  uid_t uid)
+{
+    size_t lo = 0, hi = cf->nusers;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cf->users[mid].uid < uid) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < cf->nusers && cf->users[lo].uid == uid ? &cf->users[lo] : NULL;
+}
+
+const struct nk_cred_user *nk_credfile_user_byname(const struct nk_credfile *cf,
+                                                   const char *name)
+{
+    size_t lo = 0, hi = cf->nusers;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(cf->unames[mid]->name, name) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < cf->nusers && !strcmp(cf->unames[lo]->name, name)
+        ? cf->unames[lo] : NULL;
+}
+
+const struct nk_cred_group *nk_credfile_group_bygid(const struct nk_credfile *cf,
+                                                    gid_t gid)
+{
+    size_t lo = 0, hi = cf->ngroups;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cf->groups[mid].gid < gid) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < cf->ngroups && cf->groups[lo].gid == gid ? &cf->groups[lo] : NULL;
+}
+
+const struct nk_cred_group *nk_credfile_group_byname(const struct nk_credfile *cf,
+                                                     const char *name)
+{
+    size_t lo = 0, hi = cf->ngroups;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(cf->gnames[mid]->name, name) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < cf->ngroups && !strcmp(cf->gnames[lo]->name, name)
+        ? cf->gnames[lo] : NULL;
+}
@@ -0,0 +1,189 @@
+/* csprng.c - buffered ChaCha20 CSPRNG
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "nk/csprng.h"
+#include "nk/hwrng.h"
+
+// ChaCha20 as in RFC 7539.  Four blocks are computed at once, one per
+// vector lane; GCC lowers the vector type to SSE2 or NEON where available
+// and to scalar code elsewhere.
+
+typedef uint32_t nk_v4u32 __attribute__((vector_size(16)));
+
+#define NK_CHACHA_BLOCK 64
+#define NK_CHACHA_LANES 4
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QR(a, b, c, d) do { \
+        a += b; d ^= a; d = ROTL(d, 16); \
+        c += d; b ^= c; b = ROTL(b, 12); \
+        a += b; d ^= a; d = ROTL(d, 8); \
+        c += d; b ^= c; b = ROTL(b, 7); \
+    } while (0)
+
+static inline void store32le(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+// Writes four consecutive keystream blocks starting at block 'counter'.
+static void chacha20_blocks4(const uint32_t key[8], uint32_t counter,
+                             const uint32_t nonce[3],
+                             unsigned char out[NK_CHACHA_BLOCK * NK_CHACHA_LANES])
+{
+    nk_v4u32 in[16], x[16];
+    static const uint32_t sigma[4] = {
+        0x61707865, 0x3320646e, 0x79622d32, 0x6b206574
+    };
+    for (size_t i = 0; i < 4; ++i)
+        in[i] = (nk_v4u32){ sigma[i], sigma[i], sigma[i], sigma[i] };
+    for (size_t i = 0; i < 8; ++i)
+        in[4 + i] = (nk_v4u32){ key[i], key[i], key[i], key[i] };
+    in[12] = (nk_v4u32){ counter, counter + 1, counter + 2, counter + 3 };
+    for (size_t i = 0; i < 3; ++i)
+        in[13 + i] = (nk_v4u32){ nonce[i], nonce[i], nonce[i], nonce[i] };
+    memcpy(x, in, sizeof x);
+    for (size_t i = 0; i < 10; ++i) {
+        QR(x[0], x[4], x[8], x[12]);
+        QR(x[1], x[5], x[9], x[13]);
+        QR(x[2], x[6], x[10], x[14]);
+        QR(x[3], x[7], x[11], x[15]);
+        QR(x[0], x[5], x[10], x[15]);
+        QR(x[1], x[6], x[11], x[12]);
+        QR(x[2], x[7], x[8], x[13]);
+        QR(x[3], x[4], x[9], x[14]);
+    }
+    for (size_t i = 0; i < 16; ++i) {
+        x[i] += in[i];
+        for (size_t j = 0; j < NK_CHACHA_LANES; ++j)
+            store32le(out + j * NK_CHACHA_BLOCK + i * 4, x[i][j]);
+    }
+    memset(x, 0, sizeof x);
+    memset(in, 0, sizeof in);
+    __asm__ __volatile__("" : : "r"(x), "r"(in) : "memory");
+}
+
+#undef QR
+#undef ROTL
+
+static void nk_csprng_memzero(void *p, size_t len)
+{
+    memset(p, 0, len);
+    __asm__ __volatile__("" : : "r"(p) : "memory");
+}
+
+// Refills the buffer and replaces the key with its first 32 bytes.
+static void nk_csprng_refill(struct nk_csprng *s)
+{
+    static const uint32_t nonce[3] = { 0, 0, 0 };
+    for (size_t i = 0; i < NK_CSPRNG_BUFSIZE;
+         i += NK_CHACHA_BLOCK * NK_CHACHA_LANES) {
+        chacha20_blocks4(s->key, (uint32_t)(i / NK_CHACHA_BLOCK), nonce,
+                         s->buf + i);
+    }
+    memcpy(s->key, s->buf, sizeof s->key);
+    nk_csprng_memzero(s->buf, sizeof s->key);
+    s->pos = sizeof s->key;
+}
+
+void nk_csprng_reseed(struct nk_csprng *s)
+{
+    uint32_t seed[8];
+    nk_get_hwrng(seed, sizeof seed);
+    for (size_t i = 0; i < 8; ++i)
+        s->key[i] ^= seed[i];
+    nk_csprng_memzero(seed, sizeof seed);
+    s->reseed_left = NK_CSPRNG_RESEED_BYTES;
+    // Discard anything generated under the old key.
+    nk_csprng_refill(s);
+}
+
+void nk_csprng_init(struct nk_csprng *s)
+{
+    nk_csprng_memzero(s, sizeof *s);
+    nk_csprng_reseed(s);
+}
+
+void nk_csprng_wipe(struct nk_csprng *s)
+{
+    nk_csprng_memzero(s, sizeof *s);
+}
+
+void nk_csprng_get(struct nk_csprng *s, void *out, size_t len)
+{
+    unsigned char *o = out;
+    while (len > 0) {
+        if (s->reseed_left == 0)
+            nk_csprng_reseed(s);
+        if (s->pos >= NK_CSPRNG_BUFSIZE)
+            nk_csprng_refill(s);
+        size_t n = NK_CSPRNG_BUFSIZE - s->pos;
+        if (n > len) n = len;
+        if (n > s->reseed_left) n = s->reseed_left;
+        memcpy(o, s->buf + s->pos, n);
+        nk_csprng_memzero(s->buf + s->pos, n);
+        s->pos += n;
+        s->reseed_left -= n;
+        o += n;
+        len -= n;
+    }
+}
+
+uint32_t nk_csprng_u32(struct nk_csprng *s)
+{
+    uint32_t r;
+    nk_csprng_get(s, &r, sizeof r);
+    return r;
+}
+
+uint64_t nk_csprng_u64(struct nk_csprng *s)
+{
+    uint64_t r;
+    nk_csprng_get(s, &r, sizeof r);
+    return r;
+}
+
+// Unbiased integer in [0, range) via Lemire's multiply-shift method.
+uint32_t nk_csprng_bounded(struct nk_csprng *s, uint32_t range)
+{
+    uint64_t m = (uint64_t)nk_csprng_u32(s) * range;
+    uint32_t l = (uint32_t)m;
+    if (l < range) {
+        const uint32_t t = -range % range;
+        while (l < t) {
+            m = (uint64_t)nk_csprng_u32(s) * range;
+            l = (uint32_t)m;
+        }
+    }
+    return (uint32_t)(m >> 32);
+}
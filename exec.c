@@ -26,7 +26,13 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -35,7 +41,17 @@
 #include <errno.h>
 #include <limits.h>
 #include <pwd.h>
+#include <grp.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 #include "nk/exec.h"
+#include "nk/credcache.h"
+#include "nk/malloc.h"
 
 #define DEFAULT_ROOT_PATH "/bin:/sbin:/usr/bin:/usr/sbin:/usr/local/bin:/usr/local/sbin"
 #define DEFAULT_PATH "/bin:/usr/bin:/usr/local/bin"
@@ -70,23 +86,32 @@ int nk_generate_env(uid_t uid, const char *chroot_path, const char *path_var,
                     char *env[], size_t envlen, char *envbuf, size_t envbuflen)
 {
     char pw_strs[1024];
-    struct passwd pw_s;
-    struct passwd *pw;
-    int pwr = getpwuid_r(uid, &pw_s, pw_strs, sizeof pw_strs, &pw);
-    if (pwr || !pw) return -1;
+    const char *name, *dir, *shell;
+    const struct nk_cred_user *cu = nk_cred_user_byuid(uid);
+    if (cu) {
+        name = cu->name; dir = cu->dir; shell = cu->shell;
+    } else if (nk_credcache_files_only()) {
+        return -1;
+    } else {
+        struct passwd pw_s;
+        struct passwd *pw;
+        int pwr = getpwuid_r(uid, &pw_s, pw_strs, sizeof pw_strs, &pw);
+        if (pwr || !pw) return -1;
+        name = pw->pw_name; dir = pw->pw_dir; shell = pw->pw_shell;
+    }
 
     size_t env_offset = 0;
     if (envlen-- < 1)// So we don't have to account for the terminal NULL
         return -3;
 
     NK_GEN_ENV("UID=%i", uid);
-    NK_GEN_ENV("USER=%s", pw->pw_name);
-    NK_GEN_ENV("USERNAME=%s", pw->pw_name);
-    NK_GEN_ENV("LOGNAME=%s", pw->pw_name);
-    NK_GEN_ENV("HOME=%s", pw->pw_dir);
-    NK_GEN_ENV("SHELL=%s", pw->pw_shell);
+    NK_GEN_ENV("USER=%s", name);
+    NK_GEN_ENV("USERNAME=%s", name);
+    NK_GEN_ENV("LOGNAME=%s", name);
+    NK_GEN_ENV("HOME=%s", dir);
+    NK_GEN_ENV("SHELL=%s", shell);
     NK_GEN_ENV("PATH=%s", path_var ? path_var : (uid > 0 ? DEFAULT_PATH : DEFAULT_ROOT_PATH));
-    NK_GEN_ENV("PWD=%s", !chroot_path ? pw->pw_dir : "/");
+    NK_GEN_ENV("PWD=%s", !chroot_path ? dir : "/");
     if (chroot_path && chroot(chroot_path)) return -4;
     if (chdir(chroot_path ? chroot_path : "/")) return -4;
 
@@ -94,17 +119,75 @@ int nk_generate_env(uid_t uid, const char *chroot_path, const char *path_var,
     return 0;
 }
 
-#define NK_GEN_ARG(GEN_STR, ...) do { \
-        ssize_t snlen = snprintf(argbuf, argbuflen, GEN_STR "0", __VA_ARGS__); \
-        if (snlen < 0 || (size_t)snlen >= argbuflen) { \
-            const char errstr[] = "nk_execute: constructing argument list failed\n"; \
-            write(STDERR_FILENO, errstr, sizeof errstr); \
-            _Exit(EXIT_FAILURE); \
-        } \
-        if (snlen > 0) argbuf[snlen-1] = 0; \
-        argv[curv] = argbuf; argv[++curv] = NULL; \
-        argbuf += snlen; argbuflen -= (size_t)snlen; \
-    } while (0)
+// Finds the next argument in *args.  Arguments are separated by single
+// spaces; spaces within single or double quotes do not separate arguments,
+// and the quote characters are kept.  An empty argument ends the list.
+// *args is advanced past the argument, or set to NULL at the end.
+static bool nk_next_arg(const char **args, const char **arg, size_t *arglen)
+{
+    const char *q = *args, *p = q;
+    bool squote = false, dquote = false;
+    if (!q)
+        return false;
+    for (;; ++p) {
+        switch (*p) {
+        default: continue;
+        case '\0':
+            *args = NULL;
+            goto endarg;
+        case ' ':
+            if (!squote && !dquote) {
+                *args = p + 1;
+                goto endarg;
+            }
+            continue;
+        case '\'':
+            if (!dquote)
+                squote = !squote;
+            continue;
+        case '"':
+            if (!squote)
+                dquote = !dquote;
+            continue;
+        }
+    }
+endarg:
+    if (p == q) {
+        *args = NULL;
+        return false;
+    }
+    *arg = q;
+    *arglen = (size_t)(p - q);
+    return true;
+}
+
+// Fills argv (argvlen pointers, including the terminal NULL) with argv[0]
+// derived from command and the arguments in args, storing the strings in
+// argbuf.  Arguments beyond argvlen - 1 are dropped.
+// Returns 0 on success or -1 if argbuf is too small.
+static int nk_build_argv(const char *command, const char *args,
+                         char *argv[], size_t argvlen,
+                         char *argbuf, size_t argbuflen)
+{
+    size_t curv = 0;
+    // strip the path from the command name and set argv[0]
+    const char *p = strrchr(command, '/');
+    const char *arg = p ? p + 1 : command;
+    size_t len = strlen(arg);
+    for (;;) {
+        if (len >= argbuflen)
+            return -1;
+        memcpy(argbuf, arg, len);
+        argbuf[len] = 0;
+        argv[curv++] = argbuf;
+        argbuf += len + 1;
+        argbuflen -= len + 1;
+        if (curv >= argvlen - 1 || !nk_next_arg(&args, &arg, &len))
+            break;
+    }
+    argv[curv] = NULL;
+    return 0;
+}
 
 #ifdef __GNUC__
 #pragma GCC diagnostic push
@@ -114,61 +197,322 @@ void __attribute__((noreturn))
 nk_execute(const char *command, const char *args, char * const envp[])
 {
     char *argv[MAX_ARGS];
-    char argbuf_s[MAX_ARGBUF];
-    char *argbuf = argbuf_s;
-    size_t curv = 0;
-    size_t argbuflen = sizeof argbuf_s;
+    char argbuf[MAX_ARGBUF];
 
     if (!command)
         _Exit(EXIT_SUCCESS);
 
-    // strip the path from the command name and set argv[0]
-    const char *p = strrchr(command, '/');
-    NK_GEN_ARG("%s", p ? p + 1 : command);
-
-    if (args) {
-        p = args;
-        const char *q = args;
-        bool squote = false, dquote = false, atend = false;
-        for (;; ++p) {
-            switch (*p) {
-            default: continue;
-            case '\0':
-                 atend = true;
-                 goto endarg;
-            case ' ':
-                if (!squote && !dquote)
-                    goto endarg;
-                continue;
-            case '\'':
-                if (!dquote)
-                    squote = !squote;
-                continue;
-            case '"':
-                if (!squote)
-                    dquote = !dquote;
-                continue;
+    if (nk_build_argv(command, args, argv, MAX_ARGS, argbuf, sizeof argbuf)) {
+        const char errstr[] = "nk_execute: constructing argument list failed\n";
+        write(STDERR_FILENO, errstr, sizeof errstr);
+        _Exit(EXIT_FAILURE);
+    }
+    execve(command, argv, envp);
+    {
+        const char errstr[] = "nk_execute: execve failed\n";
+        write(STDERR_FILENO, errstr, sizeof errstr);
+        _Exit(EXIT_FAILURE);
+    }
+}
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+
+#ifdef __linux__
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x00001000
+#endif
+// The child runs on its own small stack while sharing the parent's memory
+// and is only allowed to make raw system calls: glibc's set*id() wrappers
+// would try to signal the parent's other threads.
+#define NK_SPAWN_STACK_SIZE (64 * 1024)
+#ifdef SYS_setresuid32
+#define NK_SYS_setresuid SYS_setresuid32
+#define NK_SYS_setresgid SYS_setresgid32
+#define NK_SYS_setgroups SYS_setgroups32
+#else
+#define NK_SYS_setresuid SYS_setresuid
+#define NK_SYS_setresgid SYS_setresgid
+#define NK_SYS_setgroups SYS_setgroups
+#endif
+#endif
+
+struct nk_spawn_ctx {
+    const char *command;
+    char * const *argv;
+    char * const *envp;
+    const struct nk_spawn_opts *opts;
+    const sigset_t *sigmask;
+    int errfd;
+};
+
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-result"
+#endif
+static int nk_spawn_child(void *arg)
+{
+    const struct nk_spawn_ctx *c = arg;
+    const struct nk_spawn_opts *o = c->opts;
+    int errfd = c->errfd;
+    int err;
+
+    // Handlers belong to the parent and must not run in the child.
+    for (int sig = 1; sig < NSIG; ++sig) {
+        struct sigaction sa;
+        if (sigaction(sig, NULL, &sa) || sa.sa_handler == SIG_IGN
+            || sa.sa_handler == SIG_DFL)
+            continue;
+        memset(&sa, 0, sizeof sa);
+        sa.sa_handler = SIG_DFL;
+        sigaction(sig, &sa, NULL);
+    }
+    if (o && o->fd_actions_len) {
+        // Keep the error pipe out of the way of the requested fds.
+        int maxfd = -1;
+        for (size_t i = 0; i < o->fd_actions_len; ++i) {
+            if (o->fd_actions[i].fd > maxfd) maxfd = o->fd_actions[i].fd;
+            if (o->fd_actions[i].newfd > maxfd) maxfd = o->fd_actions[i].newfd;
+        }
+        if (errfd <= maxfd) {
+            errfd = fcntl(errfd, F_DUPFD_CLOEXEC, maxfd + 1);
+            if (errfd < 0) {
+                errfd = c->errfd;
+                goto fail;
             }
-endarg:
-            {
-                if (p == q) break;
-                // Push an argument.
-                if (q > p) {
-                    const char errstr[] = "nk_execute: argument length too long\n";
-                    write(STDERR_FILENO, errstr, sizeof errstr);
-                    _Exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < o->fd_actions_len; ++i) {
+            const struct nk_spawn_fd_action *a = &o->fd_actions[i];
+            switch (a->op) {
+            case NK_SPAWN_FD_DUP2:
+                if (a->fd == a->newfd) {
+                    int fl = fcntl(a->fd, F_GETFD);
+                    if (fl < 0 || fcntl(a->fd, F_SETFD, fl & ~FD_CLOEXEC) < 0)
+                        goto fail;
+                } else if (dup2(a->fd, a->newfd) < 0) {
+                    goto fail;
                 }
-                const size_t len = (size_t)(p - q);
-                NK_GEN_ARG("%.*s", (int)len, q);
-                q = p + 1;
-                if (atend || curv >= (MAX_ARGS - 1))
-                    break;
+                break;
+            case NK_SPAWN_FD_CLOSE:
+                if (close(a->fd) < 0 && errno != EBADF)
+                    goto fail;
+                break;
+            default:
+                errno = EINVAL;
+                goto fail;
             }
         }
     }
-    execve(command, argv, envp);
+    if (o && o->chroot_path) {
+        if (chroot(o->chroot_path) || chdir("/"))
+            goto fail;
+    }
+#ifdef __linux__
+    if (o && o->gid != (gid_t)-1) {
+        if (syscall(NK_SYS_setgroups, 1, &o->gid)
+            || syscall(NK_SYS_setresgid, o->gid, o->gid, o->gid))
+            goto fail;
+    }
+    if (o && o->uid != (uid_t)-1) {
+        if (syscall(NK_SYS_setresuid, o->uid, o->uid, o->uid))
+            goto fail;
+    }
+#else
+    if (o && o->gid != (gid_t)-1) {
+        if (setgroups(1, &o->gid) || setgid(o->gid))
+            goto fail;
+    }
+    if (o && o->uid != (uid_t)-1) {
+        if (setuid(o->uid))
+            goto fail;
+    }
+#endif
+    sigprocmask(SIG_SETMASK, c->sigmask, NULL);
+    execve(c->command, c->argv, c->envp);
+fail:
+    err = errno;
+    write(errfd, &err, sizeof err);
+    _exit(127);
+}
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+
+// Returns 0 and sets *pid on success, or an errno value on failure.
+static int nk_spawn_argv(pid_t *pid, const char *command, char * const argv[],
+                         char * const envp[], const struct nk_spawn_opts *opts)
+{
+    int pfd[2];
+    if (pipe2(pfd, O_CLOEXEC))
+        return errno;
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    struct nk_spawn_ctx c = {
+        .command = command, .argv = argv, .envp = envp, .opts = opts,
+        .sigmask = &old, .errfd = pfd[1],
+    };
+    pid_t cpid;
+    int ret = 0;
+#ifdef __linux__
+    void *stack = mmap(NULL, NK_SPAWN_STACK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) {
+        ret = errno;
+        goto out;
+    }
+    int flags = CLONE_VM | CLONE_VFORK | SIGCHLD;
+    if (opts && opts->pidfd)
+        flags |= CLONE_PIDFD;
+    if (opts && (opts->flags & NK_SPAWN_F_SIBLING))
+        flags |= CLONE_PARENT;
+    cpid = clone(nk_spawn_child, (char *)stack + NK_SPAWN_STACK_SIZE, flags,
+                 &c, opts ? opts->pidfd : NULL);
+    if (cpid < 0)
+        ret = errno;
+    munmap(stack, NK_SPAWN_STACK_SIZE);
+#else
+    if (opts && (opts->flags & NK_SPAWN_F_SIBLING)) {
+        ret = ENOSYS;
+        goto out;
+    }
+    cpid = fork();
+    if (cpid == 0)
+        nk_spawn_child(&c);
+    if (cpid < 0)
+        ret = errno;
+#endif
+    if (ret)
+        goto out;
+    close(pfd[1]);
+    pfd[1] = -1;
+    int cerr;
+    ssize_t r;
+    do {
+        r = read(pfd[0], &cerr, sizeof cerr);
+    } while (r < 0 && errno == EINTR);
+    if (r == (ssize_t)sizeof cerr) {
+        // The child failed before or in execve(); reap it unless it is
+        // our sibling, in which case only our parent can.
+        if (opts && (opts->flags & NK_SPAWN_F_SIBLING)) {
+            if (pid)
+                *pid = cpid;
+        } else {
+            while (waitpid(cpid, NULL, 0) < 0 && errno == EINTR);
+        }
+        if (opts && opts->pidfd) {
+            close(*opts->pidfd);
+            *opts->pidfd = -1;
+        }
+        ret = cerr;
+        goto out;
+    }
+    if (pid)
+        *pid = cpid;
+out:
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    close(pfd[0]);
+    if (pfd[1] >= 0)
+        close(pfd[1]);
+    return ret;
+}
+
+/*
+ * Starts command as a new process without copying the caller's address
+ * space.  On Linux, the child is created with clone(CLONE_VM|CLONE_VFORK),
+ * so the cost does not depend on the caller's memory size.  Arguments are
+ * parsed from args with the same rules as nk_execute().
+ *
+ * pid: set to the pid of the child on success, may be NULL
+ * command: path of the program to execute
+ * args: space-separated arguments or NULL
+ * envp: environment of the new program, eg. from nk_generate_env()
+ * opts: actions to apply in the child before execve(), or NULL
+ *
+ * returns:
+ * 0 on success
+ * an errno value if the child could not be created, or if any child action
+ * or the execve() itself failed; in the latter case the child is reaped
+ */
+int nk_spawn(pid_t *pid, const char *command, const char *args,
+             char * const envp[], const struct nk_spawn_opts *opts)
+{
+    char *argv[MAX_ARGS];
+    char argbuf[MAX_ARGBUF];
+
+    if (!command)
+        return EINVAL;
+    if (nk_build_argv(command, args, argv, MAX_ARGS, argbuf, sizeof argbuf))
+        return E2BIG;
+    return nk_spawn_argv(pid, command, argv, envp, opts);
+}
+
+/*
+ * Parses command and args once into a single allocation holding the
+ * argv array and all of its strings, so that launching the command does no
+ * parsing or formatting.  Unlike nk_execute(), there is no limit on the
+ * number or length of arguments.  Exits via suicide() if allocation fails.
+ * Returns NULL if command is NULL.
+ */
+struct nk_command *nk_command_new(const char *command, const char *args)
+{
+    if (!command)
+        return NULL;
+    const char *p = strrchr(command, '/');
+    const char *arg0 = p ? p + 1 : command;
+    const size_t cmdlen = strlen(command) + 1;
+    const size_t arg0len = strlen(arg0);
+    size_t argc = 1, strsize = arg0len + 1;
+    const char *a, *s = args;
+    size_t len;
+    while (nk_next_arg(&s, &a, &len)) {
+        ++argc;
+        strsize += len + 1;
+    }
+
+    const size_t argvsize = (argc + 1) * sizeof(char *);
+    struct nk_command *c = xmalloc(sizeof *c + argvsize + cmdlen + strsize);
+    char **argv = (char **)(c + 1);
+    char *buf = (char *)argv + argvsize;
+    memcpy(buf, command, cmdlen);
+    c->path = buf;
+    c->argv = argv;
+    c->argc = argc;
+    buf += cmdlen;
+
+    size_t i = 0;
+    a = arg0;
+    len = arg0len;
+    s = args;
+    do {
+        memcpy(buf, a, len);
+        buf[len] = 0;
+        argv[i++] = buf;
+        buf += len + 1;
+    } while (nk_next_arg(&s, &a, &len));
+    argv[i] = NULL;
+    return c;
+}
+
+void nk_command_free(struct nk_command *cmd)
+{
+    free(cmd);
+}
+
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-result"
+#endif
+void __attribute__((noreturn))
+nk_command_execute(const struct nk_command *cmd, char * const envp[])
+{
+    if (!cmd)
+        _Exit(EXIT_SUCCESS);
+    execve(cmd->path, cmd->argv, envp);
     {
-        const char errstr[] = "nk_execute: execve failed\n";
+        const char errstr[] = "nk_command_execute: execve failed\n";
         write(STDERR_FILENO, errstr, sizeof errstr);
         _Exit(EXIT_FAILURE);
     }
@@ -177,3 +521,11 @@ endarg:
 #pragma GCC diagnostic pop
 #endif
 
+// As nk_spawn(), but for a command prepared by nk_command_new().
+int nk_command_spawn(pid_t *pid, const struct nk_command *cmd,
+                     char * const envp[], const struct nk_spawn_opts *opts)
+{
+    if (!cmd)
+        return EINVAL;
+    return nk_spawn_argv(pid, cmd->path, cmd->argv, envp, opts);
+}
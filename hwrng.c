@@ -27,26 +27,55 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include "nk/hwrng.h"
 #include "nk/log.h"
 #include "nk/io.h"
 
-#ifdef NK_USE_GETRANDOM_SYSCALL
+#ifndef GRND_NONBLOCK
+#define GRND_NONBLOCK 0x0001
+#endif
+
+// Requests of at most NK_HWRNG_BATCH_MAX bytes are served from a per-thread
+// buffer that is refilled NK_HWRNG_BUFSIZE bytes at a time, so that callers
+// that repeatedly ask for a few bytes do not make a syscall each time.
+// Bytes are zeroed as soon as they are handed out.  The buffer lives in
+// MADV_WIPEONFORK memory, so a child created by any means other than
+// CLONE_VM, including a raw clone() that skips pthread_atfork() handlers,
+// starts with it empty and never returns the same bytes as its parent.
+// Where the kernel lacks MADV_WIPEONFORK, the buffer records the pid that
+// filled it and is discarded when that no longer matches.
+#define NK_HWRNG_BUFSIZE 256
+#define NK_HWRNG_BATCH_MAX 64
+
+#if defined(NK_USE_GETRANDOM_LIBC)
+// glibc routes getrandom() through the vDSO when the kernel provides it.
+#include <sys/random.h>
+#define nk_getrandom_raw(buf, len, flags) getrandom(buf, len, flags)
+#elif defined(NK_USE_GETRANDOM_SYSCALL)
 #include <sys/syscall.h>
 #include <linux/random.h>
-static bool nk_getrandom(char *seed, size_t len)
+#define nk_getrandom_raw(buf, len, flags) syscall(SYS_getrandom, buf, len, flags)
+#endif
+
+#ifdef nk_getrandom_raw
+// With GRND_NONBLOCK, returns false without logging if the kernel entropy
+// pool is not yet initialized; errno is then EAGAIN.
+static bool nk_getrandom(char *seed, size_t len, unsigned flags)
 {
     size_t fetched = 0;
     while (fetched < len) {
-        int r = syscall(SYS_getrandom, seed + fetched, len - fetched, 0);
+        ssize_t r = nk_getrandom_raw(seed + fetched, len - fetched, flags);
         if (r <= 0) {
             if (r == 0) {
                 // Failsafe to guard against infinite loops.
@@ -55,6 +84,8 @@ static bool nk_getrandom(char *seed, size_t len)
             }
             if (errno == EINTR)
                 continue;
+            if (errno == EAGAIN && (flags & GRND_NONBLOCK))
+                return false;
             log_warning("%s: getrandom() failed: %s", __func__, strerror(errno));
             return false;
         }
@@ -63,64 +94,526 @@ static bool nk_getrandom(char *seed, size_t len)
     return true;
 }
 #else
-static bool nk_getrandom(char *seed, size_t len)
+static bool nk_getrandom(char *seed, size_t len, unsigned flags)
+{
+    (void)seed; (void)len; (void)flags;
+    errno = ENOSYS;
+    return false;
+}
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+
+// RDRAND and RDSEED, when CPUID reports them, are mixed into (never used in
+// place of) the kernel-provided bytes.  RDRAND is preferred: it is an
+// SP 800-90A DRBG reseeded from the on-chip entropy source and is several
+// times faster than RDSEED, which underflows readily under load.  RDSEED
+// is used only when RDRAND is absent or has been disabled.  Each
+// instruction is retried on carry-flag failure as Intel's DRNG guide
+// recommends.  A continuous health test rejects repeated, all-zero and
+// all-one words (the failure mode of some AMD parts); a failing source is
+// disabled for the rest of the process.
+
+#define NK_RDRAND_RETRIES 10
+#define NK_RDSEED_RETRIES 128
+
+#ifdef __x86_64__
+typedef unsigned long long nk_x86rng_word;
+#define nk_rdrand_step _rdrand64_step
+#define nk_rdseed_step _rdseed64_step
+#else
+typedef unsigned int nk_x86rng_word;
+#define nk_rdrand_step _rdrand32_step
+#define nk_rdseed_step _rdseed32_step
+#endif
+
+static bool nk_has_rdrand, nk_has_rdseed;
+static __thread nk_x86rng_word nk_x86rng_last;
+
+__attribute__((target("rdrnd")))
+static bool nk_rdrand(nk_x86rng_word *v)
+{
+    for (int i = 0; i < NK_RDRAND_RETRIES; ++i) {
+        if (nk_rdrand_step(v))
+            return true;
+    }
+    return false;
+}
+
+__attribute__((target("rdseed")))
+static bool nk_rdseed(nk_x86rng_word *v)
+{
+    for (int i = 0; i < NK_RDSEED_RETRIES; ++i) {
+        if (nk_rdseed_step(v))
+            return true;
+        _mm_pause();
+    }
+    return false;
+}
+
+static bool nk_x86rng_healthy(nk_x86rng_word v)
 {
+    if (v == 0 || v == (nk_x86rng_word)-1 || v == nk_x86rng_last)
+        return false;
+    nk_x86rng_last = v;
+    return true;
+}
+
+static bool nk_x86rng_word_get(nk_x86rng_word *v)
+{
+    bool *src = NULL;
+    if (__atomic_load_n(&nk_has_rdrand, __ATOMIC_RELAXED) && nk_rdrand(v))
+        src = &nk_has_rdrand;
+    else if (__atomic_load_n(&nk_has_rdseed, __ATOMIC_RELAXED) && nk_rdseed(v))
+        src = &nk_has_rdseed;
+    if (!src)
+        return false;
+    if (nk_x86rng_healthy(*v))
+        return true;
+    __atomic_store_n(src, false, __ATOMIC_RELAXED);
+    log_warning("%s: %s failed health test; disabling it", __func__,
+                src == &nk_has_rdseed ? "RDSEED" : "RDRAND");
     return false;
 }
+
+static void nk_x86rng_init(void)
+{
+    unsigned a, b, c, d;
+    if (__get_cpuid(1, &a, &b, &c, &d))
+        nk_has_rdrand = !!(c & bit_RDRND);
+    if (__get_cpuid_count(7, 0, &a, &b, &c, &d))
+        nk_has_rdseed = !!(b & bit_RDSEED);
+    // Start-up health check: a few successive words must all pass.
+    nk_x86rng_word v;
+    for (int i = 0; i < 4 && (nk_has_rdrand || nk_has_rdseed); ++i)
+        (void)nk_x86rng_word_get(&v);
+    nk_x86rng_last = 0;
+}
+
+static void nk_x86rng_mix(char *seed, size_t len)
+{
+    nk_x86rng_word v;
+    while (len > 0) {
+        if (!nk_x86rng_word_get(&v))
+            return;
+        size_t n = len < sizeof v ? len : sizeof v;
+        const char *p = (const char *)&v;
+        for (size_t i = 0; i < n; ++i)
+            seed[i] ^= p[i];
+        seed += n;
+        len -= n;
+    }
+}
+#else
+static void nk_x86rng_init(void) {}
+static void nk_x86rng_mix(char *seed, size_t len) { (void)seed; (void)len; }
 #endif
-static bool nk_get_rnd_clk(char *seed, size_t len)
+
+// SHA-256 (FIPS 180-4), used to condition the jitter entropy samples.
+
+struct nk_sha256 {
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char buf[64];
+    size_t n;
+};
+
+static const uint32_t nk_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t nk_ror32(uint32_t x, int k)
+{
+    return (x >> k) | (x << (32 - k));
+}
+
+static void nk_sha256_block(struct nk_sha256 *c, const unsigned char *p)
+{
+    uint32_t w[64];
+    for (size_t i = 0; i < 16; ++i)
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16
+             | (uint32_t)p[i * 4 + 2] << 8 | (uint32_t)p[i * 4 + 3];
+    for (size_t i = 16; i < 64; ++i) {
+        const uint32_t s0 = nk_ror32(w[i - 15], 7) ^ nk_ror32(w[i - 15], 18)
+                          ^ (w[i - 15] >> 3);
+        const uint32_t s1 = nk_ror32(w[i - 2], 17) ^ nk_ror32(w[i - 2], 19)
+                          ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = c->h[0], b = c->h[1], cc = c->h[2], d = c->h[3];
+    uint32_t e = c->h[4], f = c->h[5], g = c->h[6], h = c->h[7];
+    for (size_t i = 0; i < 64; ++i) {
+        const uint32_t t1 = h + (nk_ror32(e, 6) ^ nk_ror32(e, 11) ^ nk_ror32(e, 25))
+                          + ((e & f) ^ (~e & g)) + nk_sha256_k[i] + w[i];
+        const uint32_t t2 = (nk_ror32(a, 2) ^ nk_ror32(a, 13) ^ nk_ror32(a, 22))
+                          + ((a & b) ^ (a & cc) ^ (b & cc));
+        h = g; g = f; f = e; e = d + t1;
+        d = cc; cc = b; b = a; a = t1 + t2;
+    }
+    c->h[0] += a; c->h[1] += b; c->h[2] += cc; c->h[3] += d;
+    c->h[4] += e; c->h[5] += f; c->h[6] += g; c->h[7] += h;
+}
+
+static void nk_sha256_init(struct nk_sha256 *c)
+{
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(c->h, iv, sizeof iv);
+    c->len = 0;
+    c->n = 0;
+}
+
+static void nk_sha256_update(struct nk_sha256 *c, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    c->len += len;
+    while (len > 0) {
+        size_t n = sizeof c->buf - c->n;
+        if (n > len) n = len;
+        memcpy(c->buf + c->n, p, n);
+        c->n += n;
+        p += n;
+        len -= n;
+        if (c->n == sizeof c->buf) {
+            nk_sha256_block(c, c->buf);
+            c->n = 0;
+        }
+    }
+}
+
+static void nk_sha256_final(struct nk_sha256 *c, unsigned char out[32])
+{
+    const uint64_t bits = c->len * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t padlen = (c->n < 56 ? 56 : 120) - c->n;
+    for (size_t i = 0; i < 8; ++i)
+        pad[padlen + i] = (unsigned char)(bits >> (56 - i * 8));
+    nk_sha256_update(c, pad, padlen + 8);
+    for (size_t i = 0; i < 8; ++i) {
+        out[i * 4] = (unsigned char)(c->h[i] >> 24);
+        out[i * 4 + 1] = (unsigned char)(c->h[i] >> 16);
+        out[i * 4 + 2] = (unsigned char)(c->h[i] >> 8);
+        out[i * 4 + 3] = (unsigned char)c->h[i];
+    }
+}
+
+// CPU execution-time jitter entropy source, used only when neither
+// getrandom() nor /dev/urandom is available.
+//
+// Each sample is the time taken by a burst of memory accesses whose
+// addresses depend on the buffer contents, followed by a branchy loop
+// whose length depends on the previous sample; cache, TLB, pipeline and
+// interrupt effects make the duration vary unpredictably.  The samples are
+// checked with the SP 800-90B section 4.4 continuous health tests, assuming
+// a min-entropy of NK_JENT_H bits per sample, and NK_JENT_OSR times the
+// needed number of samples are hashed with SHA-256 for each 32-byte block.
+// A health-test failure makes the source fail rather than emit output.
+
+#define NK_JENT_H 1
+#define NK_JENT_OSR 2
+#define NK_JENT_SAMPLES (256 / NK_JENT_H * NK_JENT_OSR)
+#define NK_JENT_MEMSIZE (64 * 1024)
+#define NK_JENT_ACCESSES 128
+// Repetition count test cutoff, 1 + ceil(20 / H), for alpha = 2^-20.
+#define NK_JENT_RCT_CUTOFF (1 + 20 / NK_JENT_H)
+// Adaptive proportion test window and cutoff for non-binary data, H = 1.
+#define NK_JENT_APT_WINDOW 512
+#define NK_JENT_APT_CUTOFF 410
+
+struct nk_jent {
+    volatile unsigned char *mem;
+    size_t idx;
+    uint64_t last;
+    uint64_t rct_val;
+    unsigned rct_count;
+    uint64_t apt_val;
+    unsigned apt_count, apt_seen;
+};
+
+static inline uint64_t nk_jent_time(void)
 {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
     struct timespec ts;
-    for (size_t i = 0; i < len; ++i) {
-        int r = clock_gettime(CLOCK_REALTIME, &ts);
-        if (r < 0) {
-            log_warning("%s: Could not call clock_gettime(CLOCK_REALTIME): %s",
-                        __func__, strerror(errno));
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static uint64_t nk_jent_sample(struct nk_jent *j)
+{
+    const uint64_t t0 = nk_jent_time();
+    size_t idx = j->idx;
+    for (size_t i = 0; i < NK_JENT_ACCESSES; ++i) {
+        const unsigned char v = j->mem[idx];
+        j->mem[idx] = (unsigned char)(v + 1);
+        idx = (idx + 4093 + (size_t)v * 67) & (NK_JENT_MEMSIZE - 1);
+    }
+    j->idx = idx;
+    uint64_t acc = j->last;
+    for (uint64_t i = 0, n = 1 + (j->last & 0x1f); i < n; ++i) {
+        if (acc & 1)
+            acc = (acc >> 1) ^ 0xd800000000000000u;
+        else
+            acc >>= 1;
+    }
+    j->mem[idx] ^= (unsigned char)acc;
+    const uint64_t delta = nk_jent_time() - t0;
+    j->last = delta;
+    return delta;
+}
+
+// SP 800-90B 4.4.1 repetition count and 4.4.2 adaptive proportion tests.
+static bool nk_jent_health(struct nk_jent *j, uint64_t v)
+{
+    if (v == j->rct_val) {
+        if (++j->rct_count >= NK_JENT_RCT_CUTOFF)
             return false;
-        }
-        char *p = (char *)&ts.tv_sec;
-        char *q = (char *)&ts.tv_nsec;
-        for (size_t j = 0; j < sizeof ts.tv_sec; ++j)
-            seed[i] ^= p[j];
-        for (size_t j = 0; j < sizeof ts.tv_nsec; ++j)
-            seed[i] ^= q[j];
-        // Force some scheduler jitter.
-        static const struct timespec st = { .tv_sec=0, .tv_nsec=1 };
-        nanosleep(&st, NULL);
+    } else {
+        j->rct_val = v;
+        j->rct_count = 1;
+    }
+    if (j->apt_seen == 0) {
+        j->apt_val = v;
+        j->apt_count = 1;
+    } else if (v == j->apt_val && ++j->apt_count >= NK_JENT_APT_CUTOFF) {
+        return false;
     }
+    if (++j->apt_seen == NK_JENT_APT_WINDOW)
+        j->apt_seen = 0;
     return true;
 }
 
-static bool nk_get_urandom(char *seed, size_t len)
+static bool nk_get_jitter(char *seed, size_t len)
+{
+    struct nk_jent j = { .rct_count = 0 };
+    unsigned char *mem = calloc(1, NK_JENT_MEMSIZE);
+    if (!mem) {
+        log_warning("%s: Could not allocate memory", __func__);
+        return false;
+    }
+    j.mem = mem;
+    bool ret = true;
+    // Warm up and prime the health tests; these samples are discarded.
+    for (size_t i = 0; i < NK_JENT_APT_WINDOW; ++i) {
+        if (!nk_jent_health(&j, nk_jent_sample(&j))) {
+            ret = false;
+            goto out;
+        }
+    }
+    unsigned char block[32];
+    uint64_t counter = 0;
+    while (len > 0) {
+        struct nk_sha256 c;
+        nk_sha256_init(&c);
+        nk_sha256_update(&c, &counter, sizeof counter);
+        ++counter;
+        for (size_t i = 0; i < NK_JENT_SAMPLES; ++i) {
+            const uint64_t v = nk_jent_sample(&j);
+            if (!nk_jent_health(&j, v)) {
+                ret = false;
+                goto out;
+            }
+            nk_sha256_update(&c, &v, sizeof v);
+        }
+        nk_sha256_final(&c, block);
+        const size_t n = len < sizeof block ? len : sizeof block;
+        memcpy(seed, block, n);
+        seed += n;
+        len -= n;
+    }
+    memset(block, 0, sizeof block);
+out:
+    if (!ret)
+        log_warning("%s: CPU jitter entropy failed health test", __func__);
+    free(mem);
+    return ret;
+}
+
+// The /dev/urandom fd is opened once and kept.  Daemons often close every
+// fd when detaching, so its identity is checked before each use and it is
+// reopened if it no longer refers to the device.
+static int nk_urandom_fd = -1;
+static dev_t nk_urandom_rdev;
+static pthread_mutex_t nk_urandom_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int nk_urandom_open_locked(void)
 {
-    int fd = open("/dev/urandom", O_RDONLY);
+    struct stat st;
+    if (nk_urandom_fd >= 0) {
+        if (!fstat(nk_urandom_fd, &st) && S_ISCHR(st.st_mode)
+            && st.st_rdev == nk_urandom_rdev)
+            return nk_urandom_fd;
+        nk_urandom_fd = -1;
+    }
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
     if (fd < 0) {
         log_warning("%s: Could not open /dev/urandom: %s", __func__,
                     strerror(errno));
-        return false;
+        return -1;
     }
+    if (fstat(fd, &st) || !S_ISCHR(st.st_mode)) {
+        log_warning("%s: /dev/urandom is not a character device", __func__);
+        close(fd);
+        return -1;
+    }
+    nk_urandom_rdev = st.st_rdev;
+    nk_urandom_fd = fd;
+    return fd;
+}
+
+static bool nk_get_urandom(char *seed, size_t len)
+{
     bool ret = true;
-    int r = safe_read(fd, seed, len);
-    if (r < 0) {
+    pthread_mutex_lock(&nk_urandom_lock);
+    int fd = nk_urandom_open_locked();
+    if (fd < 0) {
+        ret = false;
+    } else if (safe_read(fd, seed, len) != (ssize_t)len) {
         ret = false;
         log_warning("%s: Could not read /dev/urandom: %s",
                     __func__, strerror(errno));
     }
-    close(fd);
+    pthread_mutex_unlock(&nk_urandom_lock);
     return ret;
 }
 
+#ifndef MADV_WIPEONFORK
+#define MADV_WIPEONFORK 18
+#endif
+
+// All zero, and so empty, when freshly mapped or wiped by fork.
+struct nk_hwrng_buf {
+    unsigned char buf[NK_HWRNG_BUFSIZE];
+    size_t avail;   // unread bytes, at the end of buf
+    pid_t pid;      // filling process; checked only if !nk_hwrng_wipes
+};
+
+static __thread struct nk_hwrng_buf *nk_hwrng_tls;
+static pthread_once_t nk_hwrng_once = PTHREAD_ONCE_INIT;
+static pthread_key_t nk_hwrng_key;
+static bool nk_hwrng_wipes = true;
+
+static void nk_hwrng_memzero(void *p, size_t len)
+{
+    memset(p, 0, len);
+    __asm__ __volatile__("" : : "r"(p) : "memory");
+}
+
+static void nk_hwrng_buf_free(void *p)
+{
+    if (nk_hwrng_tls == p)
+        nk_hwrng_tls = NULL;
+    nk_hwrng_memzero(p, sizeof(struct nk_hwrng_buf));
+    munmap(p, sizeof(struct nk_hwrng_buf));
+}
+
+static struct nk_hwrng_buf *nk_hwrng_buf_get(void)
+{
+    struct nk_hwrng_buf *b = nk_hwrng_tls;
+    if (b)
+        return b;
+    b = mmap(NULL, sizeof *b, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED)
+        return NULL;
+    if (madvise(b, sizeof *b, MADV_WIPEONFORK))
+        __atomic_store_n(&nk_hwrng_wipes, false, __ATOMIC_RELAXED);
+#ifdef MADV_DONTDUMP
+    (void)madvise(b, sizeof *b, MADV_DONTDUMP);
+#endif
+    if (pthread_setspecific(nk_hwrng_key, b)) {
+        munmap(b, sizeof *b);
+        return NULL;
+    }
+    nk_hwrng_tls = b;
+    return b;
+}
+
+static void nk_hwrng_atfork_prepare(void)
+{
+    pthread_mutex_lock(&nk_urandom_lock);
+}
+
+static void nk_hwrng_atfork_parent(void)
+{
+    pthread_mutex_unlock(&nk_urandom_lock);
+}
+
+static void nk_hwrng_atfork_child(void)
+{
+    pthread_mutex_unlock(&nk_urandom_lock);
+    if (nk_hwrng_tls)
+        nk_hwrng_memzero(nk_hwrng_tls, sizeof *nk_hwrng_tls);
+}
+
+static void nk_hwrng_init(void)
+{
+    if (pthread_atfork(nk_hwrng_atfork_prepare, nk_hwrng_atfork_parent,
+                       nk_hwrng_atfork_child))
+        suicide("%s: pthread_atfork failed", __func__);
+    if (pthread_key_create(&nk_hwrng_key, nk_hwrng_buf_free))
+        suicide("%s: pthread_key_create failed", __func__);
+    nk_x86rng_init();
+}
+
+// Returns false if the buffer cannot be refilled without blocking, in which
+// case the caller falls back to an unbuffered, blocking request.
+static bool nk_get_buffered(char *seed, size_t len)
+{
+    struct nk_hwrng_buf *t = nk_hwrng_buf_get();
+    if (!t)
+        return false;
+    if (!__atomic_load_n(&nk_hwrng_wipes, __ATOMIC_RELAXED)
+        && t->avail && t->pid != getpid()) {
+        nk_hwrng_memzero(t->buf, sizeof t->buf);
+        t->avail = 0;
+    }
+    if (t->avail < len) {
+        char *b = (char *)t->buf;
+        if (!nk_getrandom(b, NK_HWRNG_BUFSIZE, GRND_NONBLOCK)) {
+            if (errno != ENOSYS || !nk_get_urandom(b, NK_HWRNG_BUFSIZE))
+                return false;
+        }
+        nk_x86rng_mix(b, NK_HWRNG_BUFSIZE);
+        t->avail = NK_HWRNG_BUFSIZE;
+        t->pid = getpid();
+    }
+    unsigned char *p = t->buf + NK_HWRNG_BUFSIZE - t->avail;
+    memcpy(seed, p, len);
+    nk_hwrng_memzero(p, len);
+    t->avail -= len;
+    return true;
+}
+
 void nk_get_hwrng(void *seed, size_t len)
 {
     char *s = (char *)seed;
-    if (nk_getrandom(s, len))
+    pthread_once(&nk_hwrng_once, nk_hwrng_init);
+    if (len <= NK_HWRNG_BATCH_MAX && nk_get_buffered(s, len))
         return;
-    if (nk_get_urandom(s, len))
+    if (nk_getrandom(s, len, 0) || nk_get_urandom(s, len)) {
+        nk_x86rng_mix(s, len);
         return;
-    log_warning("%s: Seeding PRNG via system clock.  May be predictable.",
-                __func__);
-    if (nk_get_rnd_clk(s, len))
+    }
+    log_warning("%s: Seeding PRNG via CPU jitter entropy.", __func__);
+    if (nk_get_jitter(s, len)) {
+        nk_x86rng_mix(s, len);
         return;
+    }
     suicide("%s: All methods to seed PRNG failed.  Exiting.", __func__);
 }
-
@@ -27,21 +27,397 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "nk/malloc.h"
 #include "nk/log.h"
 
+#ifdef NK_MALLOC_STATS
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#include <execinfo.h>
+#define NK_MALLOC_USABLE_SIZE(p) malloc_usable_size(p)
+#define NK_MALLOC_BACKTRACE 1
+#endif
+
+#define NK_MALLOC_SITES 256
+#define NK_MALLOC_SITE_DEPTH 8
+
+// Per-thread counters.  Only the owning thread writes them; they are
+// updated with relaxed atomics so that snapshots from other threads do
+// not see torn values.
+struct nk_malloc_tstats {
+    struct nk_malloc_stats s;
+    struct nk_malloc_tstats *prev, *next;
+    unsigned sample_left;
+};
+
+struct nk_malloc_site {
+    void *frames[NK_MALLOC_SITE_DEPTH];
+    int depth;
+    uint64_t count;
+    uint64_t bytes;
+};
+
+static pthread_mutex_t nk_malloc_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t nk_malloc_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t nk_malloc_stats_key;
+static struct nk_malloc_tstats *nk_malloc_threads; // live threads
+// Totals of exited threads.  Also installed as the thread's counters once
+// its destructor has run, so that allocations made by later destructors
+// are counted here, under the lock, rather than in freed memory.  Its
+// sample_left is zero, so it never samples.
+static struct nk_malloc_tstats nk_malloc_retired;
+static struct nk_malloc_site nk_malloc_sites[NK_MALLOC_SITES];
+static unsigned nk_malloc_sample_period = 1024;
+static __thread struct nk_malloc_tstats *nk_malloc_tls;
+
+#define NK_STAT_ADD(f, v) \
+    __atomic_store_n(&(f), __atomic_load_n(&(f), __ATOMIC_RELAXED) + (v), \
+                     __ATOMIC_RELAXED)
+
+static void nk_malloc_stats_add(struct nk_malloc_stats *d,
+                                const struct nk_malloc_stats *s)
+{
+    d->malloc_calls += __atomic_load_n(&s->malloc_calls, __ATOMIC_RELAXED);
+    d->malloc_bytes += __atomic_load_n(&s->malloc_bytes, __ATOMIC_RELAXED);
+    d->realloc_calls += __atomic_load_n(&s->realloc_calls, __ATOMIC_RELAXED);
+    d->realloc_bytes += __atomic_load_n(&s->realloc_bytes, __ATOMIC_RELAXED);
+    d->realloc_grow += __atomic_load_n(&s->realloc_grow, __ATOMIC_RELAXED);
+    d->realloc_shrink += __atomic_load_n(&s->realloc_shrink, __ATOMIC_RELAXED);
+    d->realloc_moved += __atomic_load_n(&s->realloc_moved, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < NK_MALLOC_HIST_BUCKETS; ++i)
+        d->size_hist[i] += __atomic_load_n(&s->size_hist[i], __ATOMIC_RELAXED);
+}
+
+static void nk_malloc_thread_exit(void *arg)
+{
+    struct nk_malloc_tstats *t = arg;
+    pthread_mutex_lock(&nk_malloc_stats_lock);
+    nk_malloc_stats_add(&nk_malloc_retired.s, &t->s);
+    if (t->prev) t->prev->next = t->next;
+    else nk_malloc_threads = t->next;
+    if (t->next) t->next->prev = t->prev;
+    pthread_mutex_unlock(&nk_malloc_stats_lock);
+    nk_malloc_tls = &nk_malloc_retired;
+    free(t);
+}
+
+// A child forked while another thread held nk_malloc_stats_lock would
+// deadlock on its next sampled allocation, so fork() waits for the lock.
+static void nk_malloc_atfork_prepare(void)
+{
+    pthread_mutex_lock(&nk_malloc_stats_lock);
+}
+
+static void nk_malloc_atfork_release(void)
+{
+    pthread_mutex_unlock(&nk_malloc_stats_lock);
+}
+
+static void nk_malloc_stats_init(void)
+{
+    pthread_key_create(&nk_malloc_stats_key, nk_malloc_thread_exit);
+    if (pthread_atfork(nk_malloc_atfork_prepare, nk_malloc_atfork_release,
+                       nk_malloc_atfork_release))
+        suicide("%s: pthread_atfork failed", __func__);
+}
+
+static void nk_malloc_stats_lock_acquire(void)
+{
+    pthread_once(&nk_malloc_stats_once, nk_malloc_stats_init);
+    pthread_mutex_lock(&nk_malloc_stats_lock);
+}
+
+static struct nk_malloc_tstats *nk_malloc_tstats(void)
+{
+    struct nk_malloc_tstats *t = nk_malloc_tls;
+    if (t)
+        return t;
+    t = calloc(1, sizeof *t);
+    if (!t)
+        return NULL;
+    t->sample_left = __atomic_load_n(&nk_malloc_sample_period, __ATOMIC_RELAXED);
+    nk_malloc_stats_lock_acquire();
+    t->next = nk_malloc_threads;
+    if (t->next) t->next->prev = t;
+    nk_malloc_threads = t;
+    pthread_mutex_unlock(&nk_malloc_stats_lock);
+    pthread_setspecific(nk_malloc_stats_key, t);
+    nk_malloc_tls = t;
+    return t;
+}
+
+// Returns the counters to update, locked if they are the shared ones.
+static struct nk_malloc_tstats *nk_malloc_stats_begin(void)
+{
+    struct nk_malloc_tstats *t = nk_malloc_tstats();
+    if (t == &nk_malloc_retired)
+        nk_malloc_stats_lock_acquire();
+    return t;
+}
+
+static void nk_malloc_stats_end(struct nk_malloc_tstats *t)
+{
+    if (t == &nk_malloc_retired)
+        pthread_mutex_unlock(&nk_malloc_stats_lock);
+}
+
+static size_t nk_malloc_bucket(size_t size)
+{
+    size_t b = size ? (size_t)(64 - __builtin_clzll((unsigned long long)size)) : 0;
+    return b < NK_MALLOC_HIST_BUCKETS ? b : NK_MALLOC_HIST_BUCKETS - 1;
+}
+
+#ifdef NK_MALLOC_BACKTRACE
+// Frames of this file that may precede the caller of xmalloc()/xrealloc().
+#define NK_MALLOC_SKIP 4
+
+// Records the call stack starting at caller, the return address of
+// xmalloc() or xrealloc().  The frames above it belong to this file and
+// vary with inlining, so they are found by searching for caller rather
+// than skipped by count.  Sites are found by open addressing on the frames.
+static void nk_malloc_sample(size_t size, void *caller)
+{
+    void *bt[NK_MALLOC_SITE_DEPTH + NK_MALLOC_SKIP];
+    int n = backtrace(bt, NK_MALLOC_SITE_DEPTH + NK_MALLOC_SKIP);
+    void **f = &caller;
+    for (int i = 0; i < n && i < NK_MALLOC_SKIP; ++i) {
+        if (bt[i] == caller) {
+            f = bt + i;
+            n -= i;
+            break;
+        }
+    }
+    if (f == &caller)
+        n = 1;
+    else if (n > NK_MALLOC_SITE_DEPTH)
+        n = NK_MALLOC_SITE_DEPTH;
+    uintptr_t h = 0;
+    for (int i = 0; i < n; ++i)
+        h = (h ^ (uintptr_t)f[i]) * 0x9e3779b97f4a7c15ull;
+    nk_malloc_stats_lock_acquire();
+    for (size_t i = 0; i < NK_MALLOC_SITES; ++i) {
+        struct nk_malloc_site *s = &nk_malloc_sites[(h + i) % NK_MALLOC_SITES];
+        if (!s->depth) {
+            memcpy(s->frames, f, (size_t)n * sizeof *f);
+            s->depth = n;
+        } else if (s->depth != n || memcmp(s->frames, f, (size_t)n * sizeof *f)) {
+            continue;
+        }
+        ++s->count;
+        s->bytes += size;
+        break;
+    }
+    pthread_mutex_unlock(&nk_malloc_stats_lock);
+}
+#else
+static void nk_malloc_sample(size_t size, void *caller)
+{
+    (void)size;
+    (void)caller;
+}
+#endif
+
+static void nk_malloc_count(struct nk_malloc_tstats *t, size_t size,
+                            void *caller)
+{
+    NK_STAT_ADD(t->s.size_hist[nk_malloc_bucket(size)], 1);
+    if (t->sample_left && !--t->sample_left) {
+        t->sample_left = __atomic_load_n(&nk_malloc_sample_period, __ATOMIC_RELAXED);
+        nk_malloc_sample(size, caller);
+    }
+}
+
+// Sums the counters of all threads, past and present.
+void nk_malloc_stats_snapshot(struct nk_malloc_stats *s)
+{
+    memset(s, 0, sizeof *s);
+    nk_malloc_stats_lock_acquire();
+    nk_malloc_stats_add(s, &nk_malloc_retired.s);
+    for (struct nk_malloc_tstats *t = nk_malloc_threads; t; t = t->next)
+        nk_malloc_stats_add(s, &t->s);
+    pthread_mutex_unlock(&nk_malloc_stats_lock);
+}
+
+void nk_malloc_stats_set_sample_period(unsigned period)
+{
+    __atomic_store_n(&nk_malloc_sample_period, period, __ATOMIC_RELAXED);
+    struct nk_malloc_tstats *t = nk_malloc_tstats();
+    if (t && t != &nk_malloc_retired)
+        t->sample_left = period;
+}
+
+static int nk_malloc_site_cmp(const void *x, const void *y)
+{
+    const struct nk_malloc_site *a = x, *b = y;
+    return (a->count < b->count) - (a->count > b->count);
+}
+
+// Writes the totals, the size histogram and the sampled call sites, most
+// frequent first, to fd.
+void nk_malloc_stats_dump(int fd)
+{
+    struct nk_malloc_stats s;
+    nk_malloc_stats_snapshot(&s);
+    dprintf(fd, "malloc: %llu calls, %llu bytes\n",
+            (unsigned long long)s.malloc_calls,
+            (unsigned long long)s.malloc_bytes);
+    dprintf(fd, "realloc: %llu calls, %llu bytes, %llu grew, %llu shrank, "
+            "%llu moved\n", (unsigned long long)s.realloc_calls,
+            (unsigned long long)s.realloc_bytes,
+            (unsigned long long)s.realloc_grow,
+            (unsigned long long)s.realloc_shrink,
+            (unsigned long long)s.realloc_moved);
+    for (size_t i = 0; i < NK_MALLOC_HIST_BUCKETS; ++i) {
+        if (!s.size_hist[i])
+            continue;
+        dprintf(fd, "size %zu-%zu: %llu\n", i ? (size_t)1 << (i - 1) : 0,
+                i ? ((size_t)1 << i) - 1 : 0,
+                (unsigned long long)s.size_hist[i]);
+    }
+
+    struct nk_malloc_site *sites = malloc(sizeof nk_malloc_sites);
+    if (!sites)
+        return;
+    nk_malloc_stats_lock_acquire();
+    memcpy(sites, nk_malloc_sites, sizeof nk_malloc_sites);
+    pthread_mutex_unlock(&nk_malloc_stats_lock);
+    qsort(sites, NK_MALLOC_SITES, sizeof *sites, nk_malloc_site_cmp);
+    for (size_t i = 0; i < NK_MALLOC_SITES && sites[i].count; ++i) {
+        dprintf(fd, "site %zu: %llu samples, %llu bytes\n", i,
+                (unsigned long long)sites[i].count,
+                (unsigned long long)sites[i].bytes);
+#ifdef NK_MALLOC_BACKTRACE
+        backtrace_symbols_fd(sites[i].frames, sites[i].depth, fd);
+#endif
+    }
+    free(sites);
+}
+#endif
+
 void *xmalloc(size_t size) {
     void *ret = malloc(size);
     if (!ret)
         suicide("%s: malloc failed", __func__);
+#ifdef NK_MALLOC_STATS
+    struct nk_malloc_tstats *t = nk_malloc_stats_begin();
+    if (t) {
+        NK_STAT_ADD(t->s.malloc_calls, 1);
+        NK_STAT_ADD(t->s.malloc_bytes, size);
+        nk_malloc_count(t, size, __builtin_return_address(0));
+        nk_malloc_stats_end(t);
+    }
+#endif
     return ret;
 }
 
 void *xrealloc(void *ptr, size_t size)
 {
+#if defined(NK_MALLOC_STATS) && defined(NK_MALLOC_USABLE_SIZE)
+    size_t oldsize = ptr ? NK_MALLOC_USABLE_SIZE(ptr) : 0;
+#endif
     void *ret = realloc(ptr, size);
     if (size && !ret)
         suicide("%s: realloc failed", __func__);
+#ifdef NK_MALLOC_STATS
+    struct nk_malloc_tstats *t = nk_malloc_stats_begin();
+    if (t) {
+        NK_STAT_ADD(t->s.realloc_calls, 1);
+        NK_STAT_ADD(t->s.realloc_bytes, size);
+#ifdef NK_MALLOC_USABLE_SIZE
+        if (size > oldsize)
+            NK_STAT_ADD(t->s.realloc_grow, 1);
+        else if (size < oldsize)
+            NK_STAT_ADD(t->s.realloc_shrink, 1);
+#endif
+        if (ptr && ret != ptr)
+            NK_STAT_ADD(t->s.realloc_moved, 1);
+        nk_malloc_count(t, size, __builtin_return_address(0));
+        nk_malloc_stats_end(t);
+    }
+#endif
     return ret;
 }
+
+static size_t nk_huge_round(size_t size)
+{
+    if (!size || size > SIZE_MAX - (NK_HUGE_PAGE_SIZE - 1))
+        suicide("%s: invalid size %zu", __func__, size);
+    return (size + NK_HUGE_PAGE_SIZE - 1) & ~(size_t)(NK_HUGE_PAGE_SIZE - 1);
+}
+
+// Maps len bytes aligned to NK_HUGE_PAGE_SIZE by over-allocating and
+// trimming, so that the kernel can back the range with huge pages.
+static void *nk_huge_map_aligned(size_t len)
+{
+    size_t maplen = len + NK_HUGE_PAGE_SIZE;
+    if (maplen < len)
+        return MAP_FAILED;
+    char *p = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return MAP_FAILED;
+    uintptr_t a = ((uintptr_t)p + NK_HUGE_PAGE_SIZE - 1)
+                  & ~(uintptr_t)(NK_HUGE_PAGE_SIZE - 1);
+    size_t lead = a - (uintptr_t)p;
+    if (lead)
+        munmap(p, lead);
+    if (maplen - lead > len)
+        munmap((char *)a + len, maplen - lead - len);
+    return (void *)a;
+}
+
+static void nk_huge_prefault(char *p, size_t len)
+{
+#ifdef MADV_POPULATE_WRITE
+    if (!madvise(p, len, MADV_POPULATE_WRITE))
+        return;
+#endif
+    const size_t pg = (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < len; i += pg)
+        *(volatile char *)(p + i) = 0;
+}
+
+void *xmalloc_huge(size_t size, int flags)
+{
+    const size_t len = nk_huge_round(size);
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    // MAP_POPULATE makes a shortage of reserved huge pages fail here
+    // rather than as SIGBUS on first touch.
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+#endif
+    if (p == MAP_FAILED) {
+        p = nk_huge_map_aligned(len);
+        if (p == MAP_FAILED)
+            suicide("%s: mmap failed: %s", __func__, strerror(errno));
+#ifdef MADV_HUGEPAGE
+        madvise(p, len, MADV_HUGEPAGE);
+#endif
+        if (flags & NK_HUGE_PREFAULT)
+            nk_huge_prefault(p, len);
+    }
+    if ((flags & NK_HUGE_LOCK) && mlock(p, len))
+        suicide("%s: mlock failed: %s", __func__, strerror(errno));
+    return p;
+}
+
+void xfree_huge(void *ptr, size_t size)
+{
+    if (ptr && munmap(ptr, nk_huge_round(size)))
+        suicide("%s: munmap failed: %s", __func__, strerror(errno));
+}
@@ -0,0 +1,417 @@
+/* net_checksum.c - Internet checksum (RFC 1071)
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "nk/net_checksum.h"
+
+// All kernels compute the ones-complement sum of the buffer taken as
+// native-endian 16-bit words, which is what net_checksum161c() has always
+// returned; RFC 1071 shows that the sum is byte-order independent, so the
+// result can be stored into a header without swapping.  Because 2^32 and
+// 2^64 are both congruent to 1 modulo 0xffff, words may be summed in wider
+// lanes and the carries folded once at the end.  Each kernel returns a
+// 64-bit ones-complement partial sum; net_checksum161c_fold64() reduces
+// it to 16 bits.
+
+static inline uint64_t nk_csum_add64(uint64_t acc, uint64_t v)
+{
+    acc += v;
+    return acc + (acc < v);
+}
+
+// Sums the tail of a buffer that is shorter than a full SWAR word.  A
+// final odd byte is summed as if followed by a zero byte.
+static uint64_t nk_csum_tail(const unsigned char *p, size_t len, uint64_t acc)
+{
+    for (; len >= 2; p += 2, len -= 2) {
+        uint16_t w;
+        memcpy(&w, p, sizeof w);
+        acc = nk_csum_add64(acc, w);
+    }
+    if (len) {
+        const unsigned char b[2] = { p[0], 0 };
+        uint16_t w;
+        memcpy(&w, b, sizeof w);
+        acc = nk_csum_add64(acc, w);
+    }
+    return acc;
+}
+
+// Each kernel body below serves three entry points: summing in place,
+// copying while summing, and copying with non-temporal stores.  The mode
+// is a constant at every call site, so each is compiled to its own loop.
+enum nk_csum_mode { NK_CSUM_SUM, NK_CSUM_COPY, NK_CSUM_COPY_NT };
+
+// Portable kernel: 64-bit loads summed with end-around carry.
+static inline __attribute__((always_inline))
+uint64_t nk_csum_swar_body(unsigned char *d, const unsigned char *p,
+                           size_t len, uint64_t acc, enum nk_csum_mode mode)
+{
+    for (; len >= 32; p += 32, len -= 32) {
+        uint64_t w[4];
+        memcpy(w, p, sizeof w);
+        if (mode != NK_CSUM_SUM) {
+            memcpy(d, w, sizeof w);
+            d += 32;
+        }
+        acc = nk_csum_add64(acc, w[0]);
+        acc = nk_csum_add64(acc, w[1]);
+        acc = nk_csum_add64(acc, w[2]);
+        acc = nk_csum_add64(acc, w[3]);
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof w);
+        if (mode != NK_CSUM_SUM) {
+            memcpy(d, &w, sizeof w);
+            d += 8;
+        }
+        acc = nk_csum_add64(acc, w);
+    }
+    if (mode != NK_CSUM_SUM && len)
+        memcpy(d, p, len);
+    return nk_csum_tail(p, len, acc);
+}
+
+static uint64_t nk_csum_swar(unsigned char *d, const unsigned char *p,
+                             size_t len, uint64_t acc)
+{
+    (void)d;
+    return nk_csum_swar_body(NULL, p, len, acc, NK_CSUM_SUM);
+}
+
+static uint64_t nk_csum_copy_swar(unsigned char *d, const unsigned char *p,
+                                  size_t len, uint64_t acc)
+{
+    return nk_csum_swar_body(d, p, len, acc, NK_CSUM_COPY);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+
+// The vector kernels split each 32-bit lane into its two 16-bit words and
+// add them into 32-bit lane accumulators.  A lane gains at most 2 * 0xffff
+// per vector, so the lanes are spilled into the 64-bit sum every
+// NK_CSUM_SIMD_BLOCK bytes, well before they can overflow.  The
+// non-temporal modes require d to be aligned to the vector size.
+#define NK_CSUM_SIMD_BLOCK (256 * 1024)
+
+__attribute__((target("sse2")))
+static uint64_t nk_csum_sse2_spill(__m128i v, uint64_t acc)
+{
+    uint32_t l[4];
+    _mm_storeu_si128((__m128i *)l, v);
+    return nk_csum_add64(acc, (uint64_t)l[0] + l[1] + l[2] + l[3]);
+}
+
+__attribute__((target("sse2")))
+static inline void nk_csum_sse2_store(unsigned char *d, __m128i v,
+                                      enum nk_csum_mode mode)
+{
+    if (mode == NK_CSUM_COPY_NT)
+        _mm_stream_si128((__m128i *)d, v);
+    else if (mode == NK_CSUM_COPY)
+        _mm_storeu_si128((__m128i *)d, v);
+}
+
+__attribute__((target("sse2"))) static inline __attribute__((always_inline))
+uint64_t nk_csum_sse2_body(unsigned char *d, const unsigned char *p,
+                           size_t len, uint64_t acc, enum nk_csum_mode mode)
+{
+    const __m128i mask = _mm_set1_epi32(0xffff);
+    while (len >= 128) {
+        size_t n = len < NK_CSUM_SIMD_BLOCK ? len : NK_CSUM_SIMD_BLOCK;
+        n &= ~(size_t)63;
+        len -= n;
+        __m128i s0 = _mm_setzero_si128(), s1 = _mm_setzero_si128();
+        for (; n; p += 64, n -= 64) {
+            __m128i a = _mm_loadu_si128((const __m128i *)p);
+            __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+            __m128i c = _mm_loadu_si128((const __m128i *)(p + 32));
+            __m128i e = _mm_loadu_si128((const __m128i *)(p + 48));
+            if (mode != NK_CSUM_SUM) {
+                nk_csum_sse2_store(d, a, mode);
+                nk_csum_sse2_store(d + 16, b, mode);
+                nk_csum_sse2_store(d + 32, c, mode);
+                nk_csum_sse2_store(d + 48, e, mode);
+                d += 64;
+            }
+            s0 = _mm_add_epi32(s0, _mm_and_si128(a, mask));
+            s1 = _mm_add_epi32(s1, _mm_srli_epi32(a, 16));
+            s0 = _mm_add_epi32(s0, _mm_and_si128(b, mask));
+            s1 = _mm_add_epi32(s1, _mm_srli_epi32(b, 16));
+            s0 = _mm_add_epi32(s0, _mm_and_si128(c, mask));
+            s1 = _mm_add_epi32(s1, _mm_srli_epi32(c, 16));
+            s0 = _mm_add_epi32(s0, _mm_and_si128(e, mask));
+            s1 = _mm_add_epi32(s1, _mm_srli_epi32(e, 16));
+        }
+        acc = nk_csum_sse2_spill(s0, acc);
+        acc = nk_csum_sse2_spill(s1, acc);
+    }
+    if (mode == NK_CSUM_COPY_NT)
+        _mm_sfence();
+    if (mode == NK_CSUM_SUM)
+        return nk_csum_swar(NULL, p, len, acc);
+    return nk_csum_copy_swar(d, p, len, acc);
+}
+
+__attribute__((target("sse2")))
+static uint64_t nk_csum_sse2(unsigned char *d, const unsigned char *p,
+                             size_t len, uint64_t acc)
+{
+    (void)d;
+    return nk_csum_sse2_body(NULL, p, len, acc, NK_CSUM_SUM);
+}
+
+__attribute__((target("sse2")))
+static uint64_t nk_csum_copy_sse2(unsigned char *d, const unsigned char *p,
+                                  size_t len, uint64_t acc)
+{
+    return nk_csum_sse2_body(d, p, len, acc, NK_CSUM_COPY);
+}
+
+__attribute__((target("sse2")))
+static uint64_t nk_csum_copy_nt_sse2(unsigned char *d, const unsigned char *p,
+                                     size_t len, uint64_t acc)
+{
+    return nk_csum_sse2_body(d, p, len, acc, NK_CSUM_COPY_NT);
+}
+
+__attribute__((target("avx2")))
+static uint64_t nk_csum_avx2_spill(__m256i v, uint64_t acc)
+{
+    uint32_t l[8];
+    _mm256_storeu_si256((__m256i *)l, v);
+    return nk_csum_add64(acc, (uint64_t)l[0] + l[1] + l[2] + l[3]
+                              + l[4] + l[5] + l[6] + l[7]);
+}
+
+__attribute__((target("avx2")))
+static inline void nk_csum_avx2_store(unsigned char *d, __m256i v,
+                                      enum nk_csum_mode mode)
+{
+    if (mode == NK_CSUM_COPY_NT)
+        _mm256_stream_si256((__m256i *)d, v);
+    else if (mode == NK_CSUM_COPY)
+        _mm256_storeu_si256((__m256i *)d, v);
+}
+
+__attribute__((target("avx2"))) static inline __attribute__((always_inline))
+uint64_t nk_csum_avx2_body(unsigned char *d, const unsigned char *p,
+                           size_t len, uint64_t acc, enum nk_csum_mode mode)
+{
+    const __m256i mask = _mm256_set1_epi32(0xffff);
+    while (len >= 128) {
+        size_t n = len < NK_CSUM_SIMD_BLOCK ? len : NK_CSUM_SIMD_BLOCK;
+        n &= ~(size_t)127;
+        len -= n;
+        __m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256();
+        for (; n; p += 128, n -= 128) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)p);
+            __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+            __m256i c = _mm256_loadu_si256((const __m256i *)(p + 64));
+            __m256i e = _mm256_loadu_si256((const __m256i *)(p + 96));
+            if (mode != NK_CSUM_SUM) {
+                nk_csum_avx2_store(d, a, mode);
+                nk_csum_avx2_store(d + 32, b, mode);
+                nk_csum_avx2_store(d + 64, c, mode);
+                nk_csum_avx2_store(d + 96, e, mode);
+                d += 128;
+            }
+            s0 = _mm256_add_epi32(s0, _mm256_and_si256(a, mask));
+            s1 = _mm256_add_epi32(s1, _mm256_srli_epi32(a, 16));
+            s0 = _mm256_add_epi32(s0, _mm256_and_si256(b, mask));
+            s1 = _mm256_add_epi32(s1, _mm256_srli_epi32(b, 16));
+            s0 = _mm256_add_epi32(s0, _mm256_and_si256(c, mask));
+            s1 = _mm256_add_epi32(s1, _mm256_srli_epi32(c, 16));
+            s0 = _mm256_add_epi32(s0, _mm256_and_si256(e, mask));
+            s1 = _mm256_add_epi32(s1, _mm256_srli_epi32(e, 16));
+        }
+        acc = nk_csum_avx2_spill(s0, acc);
+        acc = nk_csum_avx2_spill(s1, acc);
+    }
+    // GCC omits the vzeroupper before a tail call; without it the SSE2
+    // code below pays the AVX-SSE transition penalty.
+    _mm256_zeroupper();
+    if (mode == NK_CSUM_SUM)
+        return nk_csum_sse2(NULL, p, len, acc);
+    if (mode == NK_CSUM_COPY)
+        return nk_csum_copy_sse2(d, p, len, acc);
+    return nk_csum_copy_nt_sse2(d, p, len, acc);
+}
+
+__attribute__((target("avx2")))
+static uint64_t nk_csum_avx2(unsigned char *d, const unsigned char *p,
+                             size_t len, uint64_t acc)
+{
+    (void)d;
+    return nk_csum_avx2_body(NULL, p, len, acc, NK_CSUM_SUM);
+}
+
+__attribute__((target("avx2")))
+static uint64_t nk_csum_copy_avx2(unsigned char *d, const unsigned char *p,
+                                  size_t len, uint64_t acc)
+{
+    return nk_csum_avx2_body(d, p, len, acc, NK_CSUM_COPY);
+}
+
+__attribute__((target("avx2")))
+static uint64_t nk_csum_copy_nt_avx2(unsigned char *d, const unsigned char *p,
+                                     size_t len, uint64_t acc)
+{
+    return nk_csum_avx2_body(d, p, len, acc, NK_CSUM_COPY_NT);
+}
+
+static bool nk_csum_has_avx2(void)
+{
+    unsigned a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d))
+        return false;
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX))
+        return false;
+    // The OS must save the YMM state across context switches.
+    unsigned xlo, xhi;
+    __asm__ ("xgetbv" : "=a"(xlo), "=d"(xhi) : "c"(0));
+    (void)xhi;
+    if ((xlo & 6) != 6)
+        return false;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+        return false;
+    return !!(b & bit_AVX2);
+}
+
+static bool nk_csum_has_sse2(void)
+{
+#ifdef __x86_64__
+    return true;
+#else
+    unsigned a, b, c, d;
+    return __get_cpuid(1, &a, &b, &c, &d) && (d & bit_SSE2);
+#endif
+}
+#endif
+
+typedef uint64_t (*nk_csum_fn)(unsigned char *, const unsigned char *,
+                               size_t, uint64_t);
+
+struct nk_csum_impl {
+    nk_csum_fn sum;
+    nk_csum_fn copy;
+    nk_csum_fn copy_nt; // d must be aligned to NK_CSUM_NT_ALIGN
+};
+
+#define NK_CSUM_NT_ALIGN 32
+
+static const struct nk_csum_impl nk_csum_impl_swar = {
+    nk_csum_swar, nk_csum_copy_swar, nk_csum_copy_swar
+};
+#if defined(__x86_64__) || defined(__i386__)
+static const struct nk_csum_impl nk_csum_impl_sse2 = {
+    nk_csum_sse2, nk_csum_copy_sse2, nk_csum_copy_nt_sse2
+};
+static const struct nk_csum_impl nk_csum_impl_avx2 = {
+    nk_csum_avx2, nk_csum_copy_avx2, nk_csum_copy_nt_avx2
+};
+#endif
+
+static const struct nk_csum_impl *nk_csum_impl;
+
+// Chooses the kernels on first use.  Racing threads store the same
+// pointer, so no further synchronization is needed.
+static const struct nk_csum_impl *nk_csum_get_impl(void)
+{
+    const struct nk_csum_impl *r = __atomic_load_n(&nk_csum_impl, __ATOMIC_RELAXED);
+    if (r)
+        return r;
+    r = &nk_csum_impl_swar;
+#if defined(__x86_64__) || defined(__i386__)
+    if (nk_csum_has_avx2())
+        r = &nk_csum_impl_avx2;
+    else if (nk_csum_has_sse2())
+        r = &nk_csum_impl_sse2;
+#endif
+    __atomic_store_n(&nk_csum_impl, r, __ATOMIC_RELAXED);
+    return r;
+}
+
+static inline uint64_t nk_csum_sum(const void *buf, size_t size)
+{
+    return nk_csum_get_impl()->sum(NULL, (const unsigned char *)buf, size, 0);
+}
+
+// Each byte contributes to the sum according to whether it is the first
+// or second byte of its word.  Data summed from an odd offset has every
+// byte in the opposite position, and swapping the bytes of its sum puts
+// them back.
+static inline uint64_t nk_csum_swap(uint64_t v)
+{
+    const uint16_t w = net_checksum161c_fold64(v);
+    return (uint16_t)((w << 8) | (w >> 8));
+}
+
+uint16_t net_checksum161c(const void *buf, size_t size)
+{
+    return ~net_checksum161c_fold64(nk_csum_sum(buf, size));
+}
+
+void net_checksum161c_update(struct net_checksum161c_ctx *c, const void *buf,
+                             size_t size)
+{
+    uint64_t v = nk_csum_sum(buf, size);
+    if (c->len & 1)
+        v = nk_csum_swap(v);
+    c->sum = nk_csum_add64(c->sum, v);
+    c->len += size;
+}
+
+uint16_t net_checksum161c_copy(void *dst, const void *src, size_t size)
+{
+    uint64_t v = nk_csum_get_impl()->copy((unsigned char *)dst,
+                                          (const unsigned char *)src, size, 0);
+    return ~net_checksum161c_fold64(v);
+}
+
+// Bytes up to the first aligned destination address are copied normally;
+// if there is an odd number of them, the rest is summed from an odd
+// offset and must be swapped.
+uint16_t net_checksum161c_copy_nt(void *dst, const void *src, size_t size)
+{
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    size_t k = -(uintptr_t)d & (NK_CSUM_NT_ALIGN - 1);
+    if (k > size)
+        k = size;
+    uint64_t v = nk_csum_copy_swar(d, s, k, 0);
+    uint64_t w = nk_csum_get_impl()->copy_nt(d + k, s + k, size - k, 0);
+    if (k & 1)
+        w = nk_csum_swap(w);
+    return ~net_checksum161c_fold64(nk_csum_add64(v, w));
+}
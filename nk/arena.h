@@ -0,0 +1,116 @@
+/* arena.h - chunked bump allocator
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NCM_ARENA_H_
+#define NCM_ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Allocations are carved from large chunks by advancing a pointer and are
+// never freed individually; instead, everything allocated after a mark is
+// released at once by nk_arena_reset_to(), or everything by
+// nk_arena_reset().  Released chunks are kept for reuse until
+// nk_arena_destroy().  As with xmalloc(), running out of memory exits via
+// suicide(), so allocations never return NULL.
+//
+// If NK_ARENA_GUARD is defined when building the library (the
+// NCMLIB_ARENA_GUARD CMake option, on by default in Debug builds), each
+// chunk is mapped with an inaccessible guard page after it and is
+// unmapped rather than reused when released, so overruns past a chunk and
+// uses after a reset fault at once.
+
+struct nk_arena_chunk;
+
+struct nk_arena {
+    char *pos;
+    char *end;
+    struct nk_arena_chunk *head;  // current chunk; links to older ones
+    struct nk_arena_chunk *spare; // released chunks kept for reuse
+    size_t chunk_size;
+    size_t seq;                   // chunks allocated so far
+};
+
+struct nk_arena_mark {
+    struct nk_arena_chunk *chunk;
+    char *pos;
+    size_t seq;
+};
+
+#define NK_ARENA_DEFAULT_CHUNK (64 * 1024)
+#ifdef __cplusplus
+#define NK_ARENA_ALIGN alignof(max_align_t)
+#else
+#define NK_ARENA_ALIGN _Alignof(max_align_t)
+#endif
+
+void nk_arena_init(struct nk_arena *a, size_t chunk_size);
+void nk_arena_destroy(struct nk_arena *a);
+void *nk_arena_alloc_slow(struct nk_arena *a, size_t size, size_t align);
+void nk_arena_reset_to(struct nk_arena *a, struct nk_arena_mark m);
+char *nk_arena_strdup(struct nk_arena *a, const char *s);
+void *nk_arena_memdup(struct nk_arena *a, const void *p, size_t size);
+
+// align must be a power of two.
+static inline void *nk_arena_alloc_aligned(struct nk_arena *a, size_t size,
+                                           size_t align)
+{
+    uintptr_t p = ((uintptr_t)a->pos + (align - 1)) & ~(uintptr_t)(align - 1);
+    if (a->pos && p <= (uintptr_t)a->end && size <= (uintptr_t)a->end - p) {
+        a->pos = (char *)p + size;
+        return (void *)p;
+    }
+    return nk_arena_alloc_slow(a, size, align);
+}
+
+static inline void *nk_arena_alloc(struct nk_arena *a, size_t size)
+{
+    return nk_arena_alloc_aligned(a, size, NK_ARENA_ALIGN);
+}
+
+static inline struct nk_arena_mark nk_arena_get_mark(const struct nk_arena *a)
+{
+    struct nk_arena_mark m = { a->head, a->pos, a->seq };
+    return m;
+}
+
+static inline void nk_arena_reset(struct nk_arena *a)
+{
+    struct nk_arena_mark m = { NULL, NULL, 0 };
+    nk_arena_reset_to(a, m);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef NCMLIB_ARENA_HPP_
+#define NCMLIB_ARENA_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define NK_ARENA_HAVE_PMR 1
+#endif
+#include <nk/arena.h>
+
+namespace nk {
+
+// Owns an nk_arena.  Memory handed out through the adapters below is
+// released all at once by reset(), an arena_scope, or destruction.
+class arena final
+{
+public:
+    explicit arena(size_t chunk_size = 0) noexcept { nk_arena_init(&a_, chunk_size); }
+    ~arena() { nk_arena_destroy(&a_); }
+    arena(const arena &) = delete;
+    arena &operator=(const arena &) = delete;
+
+    void *allocate(size_t size, size_t align = alignof(std::max_align_t)) noexcept {
+        return nk_arena_alloc_aligned(&a_, size, align);
+    }
+    nk_arena_mark mark() const noexcept { return nk_arena_get_mark(&a_); }
+    void reset_to(nk_arena_mark m) noexcept { nk_arena_reset_to(&a_, m); }
+    void reset() noexcept { nk_arena_reset(&a_); }
+    nk_arena *get() noexcept { return &a_; }
+private:
+    nk_arena a_;
+};
+
+// Releases everything allocated from an arena during its lifetime.
+class arena_scope final
+{
+public:
+    explicit arena_scope(arena &a) noexcept : a_(a), m_(a.mark()) {}
+    ~arena_scope() { a_.reset_to(m_); }
+    arena_scope(const arena_scope &) = delete;
+    arena_scope &operator=(const arena_scope &) = delete;
+private:
+    arena &a_;
+    nk_arena_mark m_;
+};
+
+// Standard allocator that draws from an arena; deallocate() is a no-op.
+// Objects must not outlive the memory's release, and destructors still
+// run as usual.
+template <typename T>
+struct arena_allocator
+{
+    typedef T value_type;
+    explicit arena_allocator(arena &a) noexcept : a_(&a) {}
+    template <typename U>
+    arena_allocator(const arena_allocator<U> &o) noexcept : a_(o.a_) {}
+
+    T *allocate(size_t n) {
+        if (n > SIZE_MAX / sizeof(T))
+            throw std::bad_array_new_length();
+        return static_cast<T *>(a_->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T *, size_t) noexcept {}
+
+    template <typename U> friend struct arena_allocator;
+    template <typename U>
+    bool operator==(const arena_allocator<U> &o) const noexcept { return a_ == o.a_; }
+    template <typename U>
+    bool operator!=(const arena_allocator<U> &o) const noexcept { return a_ != o.a_; }
+private:
+    arena *a_;
+};
+
+#ifdef NK_ARENA_HAVE_PMR
+// std::pmr adapter, for use with std::pmr containers.
+class arena_resource final : public std::pmr::memory_resource
+{
+public:
+    explicit arena_resource(arena &a) noexcept : a_(a) {}
+private:
+    void *do_allocate(size_t bytes, size_t align) override { return a_.allocate(bytes, align); }
+    void do_deallocate(void *, size_t, size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource &o) const noexcept override { return this == &o; }
+    arena &a_;
+};
+#endif
+
+}
+
+#endif
@@ -0,0 +1,161 @@
+/* buf.h - growable byte buffer with headroom
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NCM_BUF_H_
+#define NCM_BUF_H_
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A byte buffer whose contents live in [data, data + len) of a larger
+// storage area.  Space before the contents (headroom) lets protocol
+// headers be prepended with nk_buf_push() without moving the payload, and
+// space after it (tailroom) is filled by appends.  Storage grows
+// geometrically at either end, so a sequence of appends or of prepends
+// costs amortized O(1) per byte.
+//
+// Buffers of up to NK_BUF_INLINE bytes of storage, headroom included, are
+// kept inside the struct and never touch the heap.  Storage is addressed
+// relative to the struct, so an nk_buf may be copied with memcpy() to move
+// it (not to duplicate it).  As with xmalloc(), running out of memory
+// exits via suicide().
+//
+// To receive data in place, reserve tailroom, fill it, then commit:
+//
+//     char *p = nk_buf_reserve(&b, 4096);
+//     ssize_t r = safe_read(fd, p, 4096);
+//     if (r > 0) nk_buf_commit(&b, (size_t)r);
+//
+// which is what nk_buf_read() and nk_buf_recv() do.
+
+#define NK_BUF_INLINE 64
+
+struct nk_buf {
+    char *heap;      // NULL while storage is inline
+    size_t head;     // offset of the contents within storage
+    size_t len;      // length of the contents
+    size_t cap;      // size of storage
+    size_t headroom; // headroom restored by nk_buf_reset()
+    char inl[NK_BUF_INLINE];
+};
+
+void nk_buf_init(struct nk_buf *b, size_t headroom);
+void nk_buf_destroy(struct nk_buf *b);
+void nk_buf_grow(struct nk_buf *b, size_t front, size_t back);
+ssize_t nk_buf_read(struct nk_buf *b, int fd, size_t len);
+ssize_t nk_buf_recv(struct nk_buf *b, int fd, size_t len, int flags);
+
+static inline char *nk_buf_storage(struct nk_buf *b)
+{
+    return b->heap ? b->heap : b->inl;
+}
+static inline char *nk_buf_data(struct nk_buf *b)
+{
+    return nk_buf_storage(b) + b->head;
+}
+static inline size_t nk_buf_len(const struct nk_buf *b) { return b->len; }
+static inline size_t nk_buf_headroom(const struct nk_buf *b) { return b->head; }
+static inline size_t nk_buf_tailroom(const struct nk_buf *b)
+{
+    return b->cap - b->head - b->len;
+}
+
+// Ensures at least len bytes of tailroom and returns a pointer to it.
+// The bytes become part of the contents only once committed.
+static inline char *nk_buf_reserve(struct nk_buf *b, size_t len)
+{
+    if (nk_buf_tailroom(b) < len)
+        nk_buf_grow(b, 0, len);
+    return nk_buf_data(b) + b->len;
+}
+// Appends len bytes previously written to reserved tailroom.
+static inline void nk_buf_commit(struct nk_buf *b, size_t len)
+{
+    b->len += len;
+}
+// Appends len uninitialized bytes and returns a pointer to them.
+static inline char *nk_buf_put(struct nk_buf *b, size_t len)
+{
+    char *p = nk_buf_reserve(b, len);
+    b->len += len;
+    return p;
+}
+static inline void nk_buf_append(struct nk_buf *b, const void *src, size_t len)
+{
+    if (len)
+        memcpy(nk_buf_put(b, len), src, len);
+}
+// Prepends len uninitialized bytes and returns a pointer to them.  This
+// only moves the contents if the headroom is exhausted.
+static inline char *nk_buf_push(struct nk_buf *b, size_t len)
+{
+    if (b->head < len)
+        nk_buf_grow(b, len, 0);
+    b->head -= len;
+    b->len += len;
+    return nk_buf_data(b);
+}
+static inline void nk_buf_prepend(struct nk_buf *b, const void *src, size_t len)
+{
+    if (len)
+        memcpy(nk_buf_push(b, len), src, len);
+}
+// Removes len bytes from the front of the contents.
+static inline void nk_buf_consume(struct nk_buf *b, size_t len)
+{
+    if (len >= b->len) {
+        b->head = b->headroom;
+        b->len = 0;
+        return;
+    }
+    b->head += len;
+    b->len -= len;
+}
+// Shortens the contents to at most len bytes.
+static inline void nk_buf_truncate(struct nk_buf *b, size_t len)
+{
+    if (len < b->len)
+        b->len = len;
+}
+// Empties the buffer, keeping its storage.
+static inline void nk_buf_reset(struct nk_buf *b)
+{
+    b->head = b->headroom;
+    b->len = 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
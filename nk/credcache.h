@@ -0,0 +1,74 @@
+/* credcache.h - cached passwd and group lookups
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NCM_CREDCACHE_H_
+#define NCM_CREDCACHE_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// A process-wide cache of the passwd and group databases.  The whole
+// database is enumerated once through NSS (getpwent_r/getgrent_r) into an
+// immutable snapshot of hash tables, so a lookup is a hash probe that
+// takes no lock.  The snapshot is loaded on first use or by
+// nk_credcache_load(); at most once per second, a lookup compares the
+// mtimes of /etc/passwd and /etc/group with those at load time and
+// reloads if either changed.  Entries from NSS sources that cannot be
+// enumerated are not cached, and lookups for them return NULL.
+//
+// nk_credcache_use_files() instead reads passwd and group files directly
+// (see nk/credfile.h), without NSS; lookups then cost a binary search.
+//
+// A replaced snapshot is kept for a grace period of 60 seconds, as readers
+// may still be using it, and then freed on a later reload.  Entries
+// returned by a lookup must therefore be used or copied promptly rather
+// than held; all entries become invalid at nk_credcache_free().
+
+struct nk_cred_user {
+    const char *name;
+    const char *dir;
+    const char *shell;
+    uid_t uid;
+    gid_t gid;
+};
+
+struct nk_cred_group {
+    const char *name;
+    gid_t gid;
+};
+
+int nk_credcache_load(void);
+int nk_credcache_use_files(const char *root);
+bool nk_credcache_files_only(void);
+void nk_credcache_free(void);
+const struct nk_cred_user *nk_cred_user_byuid(uid_t uid);
+const struct nk_cred_user *nk_cred_user_byname(const char *name);
+const struct nk_cred_group *nk_cred_group_bygid(gid_t gid);
+const struct nk_cred_group *nk_cred_group_byname(const char *name);
+
+#endif
@@ -0,0 +1,56 @@
+/* credfile.h - passwd and group file index without NSS
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NCM_CREDFILE_H_
+#define NCM_CREDFILE_H_
+
+#include <sys/types.h>
+#include "nk/credcache.h"
+
+// Reads passwd(5) and group(5) format files directly, without NSS.  Each
+// file is mapped privately and split in place in one pass, so entry
+// strings point into the mapping; a sorted index then answers lookups by
+// id or name with a binary search.  If a key appears more than once, the
+// first entry is returned, as NSS would.  NIS compat ("+"/"-") lines and
+// comments are skipped.
+
+struct nk_credfile;
+
+int nk_credfile_open(struct nk_credfile **cf, const char *passwd_path,
+                     const char *group_path);
+void nk_credfile_close(struct nk_credfile *cf);
+const struct nk_cred_user *nk_credfile_user_byuid(const struct nk_credfile *cf,
+                                                  uid_t uid);
+const struct nk_cred_user *nk_credfile_user_byname(const struct nk_credfile *cf,
+                                                   const char *name);
+const struct nk_cred_group *nk_credfile_group_bygid(const struct nk_credfile *cf,
+                                                    gid_t gid);
+const struct nk_cred_group *nk_credfile_group_byname(const struct nk_credfile *cf,
+                                                     const char *name);
+
+#endif
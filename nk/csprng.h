@@ -0,0 +1,63 @@
+/* csprng.h - buffered ChaCha20 CSPRNG
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef NCMLIB_CSPRNG_H_
+#define NCMLIB_CSPRNG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Cryptographically secure PRNG that expands a 256-bit key with ChaCha20
+// into a buffer and hands out bytes from it.  Uses fast key erasure: the
+// first 32 bytes of each refill immediately replace the key, and bytes are
+// zeroed as soon as they are returned, so a later compromise of the state
+// does not reveal earlier outputs.
+//
+// The key is mixed with fresh nk_get_hwrng() output after every
+// NK_CSPRNG_RESEED_BYTES of output.  A state must not be shared between
+// threads without external locking, and must be reseeded in a child after
+// fork() (see nk/random_tls.h for a state that handles both).
+
+#define NK_CSPRNG_BUFSIZE 1024
+#define NK_CSPRNG_RESEED_BYTES (1024 * 1024)
+
+struct nk_csprng {
+    uint32_t key[8];
+    size_t pos;
+    size_t reseed_left;
+    unsigned char buf[NK_CSPRNG_BUFSIZE];
+};
+
+void nk_csprng_init(struct nk_csprng *s);
+void nk_csprng_reseed(struct nk_csprng *s);
+void nk_csprng_wipe(struct nk_csprng *s);
+void nk_csprng_get(struct nk_csprng *s, void *out, size_t len);
+uint32_t nk_csprng_u32(struct nk_csprng *s);
+uint64_t nk_csprng_u64(struct nk_csprng *s);
+uint32_t nk_csprng_bounded(struct nk_csprng *s, uint32_t range);
+
+#endif
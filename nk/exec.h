@@ -29,10 +29,60 @@
 #ifndef NCM_EXEC_H_
 #define NCM_EXEC_H_
 
+#include <stddef.h>
+#include <sys/types.h>
+
+enum nk_spawn_fd_op {
+    NK_SPAWN_FD_DUP2,  // dup2(fd, newfd); clears FD_CLOEXEC if fd == newfd
+    NK_SPAWN_FD_CLOSE, // close(fd)
+};
+
+struct nk_spawn_fd_action {
+    int op;
+    int fd;
+    int newfd;
+};
+
+// The child becomes a child of the caller's parent rather than of the
+// caller (CLONE_PARENT, Linux only).  The caller cannot reap it, so *pid is
+// set even when nk_spawn() fails after the child was created.
+#define NK_SPAWN_F_SIBLING 0x1
+
+// Actions applied in the child before execve(), in this order: fd actions,
+// chroot (followed by chdir("/")), then gid (with supplementary groups set
+// to just gid) and uid.  A uid or gid of -1 is left unchanged.  If pidfd is
+// non-NULL, it receives a pidfd for the child (Linux >= 5.2).  flags is a
+// mask of NK_SPAWN_F_* values.
+struct nk_spawn_opts {
+    const struct nk_spawn_fd_action *fd_actions;
+    size_t fd_actions_len;
+    const char *chroot_path;
+    uid_t uid;
+    gid_t gid;
+    int *pidfd;
+    unsigned flags;
+};
+
+// A command line parsed once by nk_command_new() and freed with
+// nk_command_free(); argv[argc] is NULL.
+struct nk_command {
+    const char *path;
+    char **argv;
+    size_t argc;
+};
+
 int nk_generate_env(uid_t uid, const char *chroot_path, const char *path_var,
                     char *env[], size_t envlen, char *envbuf, size_t envbuflen);
 void __attribute__((noreturn))
     nk_execute(const char *command, const char *args, char * const envp[]) ;
+int nk_spawn(pid_t *pid, const char *command, const char *args,
+             char * const envp[], const struct nk_spawn_opts *opts);
+struct nk_command *nk_command_new(const char *command, const char *args);
+void nk_command_free(struct nk_command *cmd);
+void __attribute__((noreturn))
+    nk_command_execute(const struct nk_command *cmd, char * const envp[]);
+int nk_command_spawn(pid_t *pid, const struct nk_command *cmd,
+                     char * const envp[], const struct nk_spawn_opts *opts);
 
 #endif
 
@@ -30,7 +30,68 @@
 #ifndef NCM_MALLOC_H_
 #define NCM_MALLOC_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 void *xmalloc(size_t size);
 void *xrealloc(void *ptr, size_t size);
 
+// Page-aligned allocations for large, hot buffers such as lookup tables.
+// The size is rounded up to a multiple of NK_HUGE_PAGE_SIZE.  Explicit
+// huge pages (MAP_HUGETLB) are used if the system has any reserved;
+// otherwise the mapping is aligned to NK_HUGE_PAGE_SIZE and marked for
+// transparent huge pages.  NK_HUGE_PREFAULT populates every page before
+// returning, and NK_HUGE_LOCK also locks them with mlock(), so that no
+// page faults occur on first access.  Failure exits via suicide().
+// Memory must be released with xfree_huge() and the size that was
+// requested.
+#define NK_HUGE_PAGE_SIZE (2u * 1024 * 1024)
+#define NK_HUGE_PREFAULT 1
+#define NK_HUGE_LOCK 2
+
+void *xmalloc_huge(size_t size, int flags);
+void xfree_huge(void *ptr, size_t size);
+
+// Allocation statistics for xmalloc() and xrealloc(), collected only if
+// the library is built with NK_MALLOC_STATS (the NCMLIB_MALLOC_STATS
+// CMake option); otherwise the functions below do nothing and snapshots
+// are all zero.  Counters are kept per thread and summed by
+// nk_malloc_stats_snapshot(), so recording an allocation takes no lock.
+//
+// size_hist[0] counts zero-byte requests and size_hist[i] requests of
+// [2^(i-1), 2^i) bytes.  A realloc is counted as growing or shrinking
+// relative to the usable size of the old block, and as moved if the
+// block's address changed.  One in every sample_period allocations
+// (default 1024, 0 to disable) records the caller's backtrace; dumps
+// list the most frequently sampled call sites.
+
+#define NK_MALLOC_HIST_BUCKETS 48
+
+struct nk_malloc_stats {
+    uint64_t malloc_calls;
+    uint64_t malloc_bytes;
+    uint64_t realloc_calls;
+    uint64_t realloc_bytes;
+    uint64_t realloc_grow;
+    uint64_t realloc_shrink;
+    uint64_t realloc_moved;
+    uint64_t size_hist[NK_MALLOC_HIST_BUCKETS];
+};
+
+#ifdef NK_MALLOC_STATS
+void nk_malloc_stats_snapshot(struct nk_malloc_stats *s);
+void nk_malloc_stats_dump(int fd);
+void nk_malloc_stats_set_sample_period(unsigned period);
+#else
+static inline void nk_malloc_stats_snapshot(struct nk_malloc_stats *s)
+{
+    *s = (struct nk_malloc_stats){0};
+}
+static inline void nk_malloc_stats_dump(int fd) { (void)fd; }
+static inline void nk_malloc_stats_set_sample_period(unsigned period)
+{
+    (void)period;
+}
+#endif
+
 #endif
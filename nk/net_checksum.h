@@ -1,7 +1,13 @@
 #ifndef NCMLIB_NET_CHECKSUM_H
 #define NCMLIB_NET_CHECKSUM_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 // When summing ones-complement 16-bit values using a 32-bit unsigned
 // representation, fold the carry bits that have spilled into the upper
@@ -14,30 +20,47 @@ static inline uint16_t net_checksum161c_foldcarry(uint32_t v)
     return v;
 }
 
-// This function is not suitable for summing buffers that are greater than
-// 128k bytes in length: failure case will be incorrect checksums via
-// unsigned overflow, which is a defined operation and is safe.  This limit
-// should not be an issue for IPv4 or IPv6 packet, which are limited to
-// at most 64k bytes.
-static uint16_t net_checksum161c(const void *buf, size_t size)
-{
-    uint32_t sum = 0;
-    int odd = size & 0x01;
-    size_t i;
-    size &= ~((size_t)0x01);
-    size >>= 1;
-    uint8_t *b = (uint8_t *)buf;
-    for (i = 0; i < size; ++i) {
-        uint16_t hi = b[i*2];
-        uint16_t lo = b[i*2+1];
-        sum += ntohs((lo + (hi << 8)));
-    }
-    if (odd) {
-        uint16_t hi = b[i*2];
-        uint16_t lo = 0;
-        sum += ntohs((lo + (hi << 8)));
-    }
-    return ~net_checksum161c_foldcarry(sum);
+// Reduces a 64-bit ones-complement sum to 16 bits.
+static inline uint16_t net_checksum161c_fold64(uint64_t v)
+{
+    v = (v >> 32) + (v & 0xffffffffu);
+    v = (v >> 32) + (v & 0xffffffffu);
+    return net_checksum161c_foldcarry((uint32_t)v);
+}
+
+// Returns the Internet checksum (RFC 1071) of buf, in the same byte order
+// as the buffer, so that it may be stored directly into a header.  Sums
+// are accumulated in 64 bits, so there is no limit on size.  SSE2 or AVX2
+// is used when the CPU supports it.
+uint16_t net_checksum161c(const void *buf, size_t size);
+
+// Copies size bytes from src to dst and returns the checksum of the data,
+// reading it only once.  The _nt form writes dst with non-temporal stores
+// that bypass the cache, for payloads too large to stay cached or that
+// will not be read again soon by this CPU.  The buffers must not overlap.
+uint16_t net_checksum161c_copy(void *dst, const void *src, size_t size);
+uint16_t net_checksum161c_copy_nt(void *dst, const void *src, size_t size);
+
+// Streaming form of net_checksum161c() for data split across buffers,
+// such as scatter-gather lists.  Fragments may have any length; a
+// fragment that starts at an odd offset in the stream is summed and then
+// byte-swapped, so the result equals net_checksum161c() of the
+// concatenation.
+struct net_checksum161c_ctx {
+    uint64_t sum;
+    size_t len;
+};
+
+static inline void net_checksum161c_init(struct net_checksum161c_ctx *c)
+{
+    c->sum = 0;
+    c->len = 0;
+}
+void net_checksum161c_update(struct net_checksum161c_ctx *c, const void *buf,
+                             size_t size);
+static inline uint16_t net_checksum161c_final(const struct net_checksum161c_ctx *c)
+{
+    return ~net_checksum161c_fold64(c->sum);
 }
 
 // For two sequences of bytes A and B that return checksums CS(A) and CS(B),
@@ -50,5 +73,61 @@ static inline uint16_t net_checksum161c_add(uint16_t a, uint16_t b)
     return ~net_checksum161c_foldcarry((~A & 0xffffu) + (~B & 0xffffu));
 }
 
+// Incremental update of a stored checksum after fields that it covers
+// are rewritten, per RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m').  All values
+// are as stored in the packet, and fields must start at an even offset
+// from the start of the checksummed data.
+//
+// The diff functions return the change m' - m of one field as a partial
+// sum; several may be added together (up to 2^30 of them) and applied
+// with one call to net_checksum161c_adjust(), e.g. for a NAT rewrite of an
+// address and a port:
+//
+//     th->check = net_checksum161c_adjust(th->check,
+//         net_checksum161c_diff32(oldaddr, newaddr) +
+//         net_checksum161c_diff16(oldport, newport));
+static inline uint64_t net_checksum161c_diff16(uint16_t from, uint16_t to)
+{
+    return (uint64_t)(uint16_t)~from + to;
+}
+static inline uint64_t net_checksum161c_diff32(uint32_t from, uint32_t to)
+{
+    return (uint64_t)~from + to;
+}
+// from and to each point to 16 bytes, e.g. an IPv6 address.
+static inline uint64_t net_checksum161c_diff128(const void *from, const void *to)
+{
+    uint32_t a[4], b[4];
+    memcpy(a, from, sizeof a);
+    memcpy(b, to, sizeof b);
+    uint64_t d = 0;
+    for (int i = 0; i < 4; ++i)
+        d += net_checksum161c_diff32(a[i], b[i]);
+    return d;
+}
+static inline uint16_t net_checksum161c_adjust(uint16_t hc, uint64_t diff)
+{
+    return ~net_checksum161c_fold64((uint64_t)(uint16_t)~hc + diff);
+}
+
+static inline uint16_t net_checksum161c_update16(uint16_t hc, uint16_t from,
+                                                 uint16_t to)
+{
+    return net_checksum161c_adjust(hc, net_checksum161c_diff16(from, to));
+}
+static inline uint16_t net_checksum161c_update32(uint16_t hc, uint32_t from,
+                                                 uint32_t to)
+{
+    return net_checksum161c_adjust(hc, net_checksum161c_diff32(from, to));
+}
+static inline uint16_t net_checksum161c_update128(uint16_t hc, const void *from,
+                                                  const void *to)
+{
+    return net_checksum161c_adjust(hc, net_checksum161c_diff128(from, to));
+}
+
+#ifdef __cplusplus
+}
 #endif
 
+#endif
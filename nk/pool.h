@@ -0,0 +1,70 @@
+/* pool.h - fixed-size object pools
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NCM_POOL_H_
+#define NCM_POOL_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A pool hands out objects of one fixed size.  Each thread keeps a small
+// cache of free objects, so nk_pool_get() and nk_pool_put() usually touch
+// only thread-local state; caches exchange objects with a shared depot
+// in batches of NK_POOL_BATCH, so the depot lock is taken once per batch
+// rather than per object.  Objects may be returned by a different thread
+// than the one that took them.  Memory is obtained in slabs and is only
+// returned to the system by nk_pool_destroy().  As with xmalloc(),
+// running out of memory exits via suicide().
+//
+// Objects are aligned to 16 bytes, or to a 64-byte cache line with
+// NK_POOL_ALIGNED, which also rounds their size up so that no two objects
+// share a line.  With NK_POOL_NUMA, slabs are bound to the NUMA node of
+// the thread that first touches them (MPOL_LOCAL) rather than following
+// the process memory policy.  Slabs are 64 KiB, which bounds the object
+// size; nk_pool_new() exits via suicide() for objects that do not fit.
+
+#define NK_POOL_ALIGNED 0x1
+#define NK_POOL_NUMA    0x2
+#define NK_POOL_BATCH 32
+
+struct nk_pool;
+
+struct nk_pool *nk_pool_new(size_t size, unsigned flags);
+void nk_pool_destroy(struct nk_pool *p);
+void *nk_pool_get(struct nk_pool *p);
+void nk_pool_put(struct nk_pool *p, void *obj);
+size_t nk_pool_object_size(const struct nk_pool *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef NCMLIB_POOL_HPP_
+#define NCMLIB_POOL_HPP_
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <nk/pool.h>
+
+namespace nk {
+
+// Typed wrapper around nk_pool: create() constructs a T in pooled memory
+// and destroy() runs its destructor and returns the memory to the pool.
+template <typename T>
+class object_pool final
+{
+public:
+    static_assert(alignof(T) <= 64, "object_pool supports alignment up to 64");
+
+    explicit object_pool(unsigned flags = 0)
+        : p_(nk_pool_new(sizeof(T), flags | (alignof(T) > 16 ? NK_POOL_ALIGNED : 0))) {}
+    ~object_pool() { nk_pool_destroy(p_); }
+    object_pool(const object_pool &) = delete;
+    object_pool &operator=(const object_pool &) = delete;
+
+    template <typename... Args>
+    T *create(Args &&... args) {
+        void *m = nk_pool_get(p_);
+        try {
+            return ::new (m) T(std::forward<Args>(args)...);
+        } catch (...) {
+            nk_pool_put(p_, m);
+            throw;
+        }
+    }
+    void destroy(T *o) noexcept {
+        if (!o)
+            return;
+        o->~T();
+        nk_pool_put(p_, o);
+    }
+
+    struct deleter {
+        object_pool *pool;
+        void operator()(T *o) const noexcept { pool->destroy(o); }
+    };
+    typedef std::unique_ptr<T, deleter> unique_ptr;
+
+    template <typename... Args>
+    unique_ptr make_unique(Args &&... args) {
+        return unique_ptr(create(std::forward<Args>(args)...), deleter{ this });
+    }
+private:
+    nk_pool *p_;
+};
+
+}
+
+#endif
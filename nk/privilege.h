@@ -35,6 +35,7 @@
 #endif
 
 void nk_set_chroot(const char *chroot_dir);
+void nk_lock_memory(void);
 void nk_set_uidgid(uid_t uid, gid_t gid, const unsigned char *caps,
                    size_t caplen);
 uid_t nk_uidgidbyname(const char *username, uid_t *uid, gid_t *gid);
@@ -30,11 +30,57 @@
 
 #include <stdint.h>
 
+// Tyche PRNG: https://eden.dei.uc.pt/~sneves/pubs/2011-snfa2.pdf
+//
+// The round and seeding functions below are the single implementation of
+// Tyche that is shared by the C nk_random_* API and by nk::rng::tyche in
+// tyche.hpp, so a state or seed may be moved freely between C and C++
+// components and will produce an identical stream.  They are constexpr
+// when compiled as C++ so that known-answer vectors can be checked at
+// compile time.
+
+#ifdef __cplusplus
+#define NK_TYCHE_CONSTEXPR constexpr
+#else
+#define NK_TYCHE_CONSTEXPR
+#endif
+
+#define NK_TYCHE_SEED2 2654435769u
+#define NK_TYCHE_SEED3 1367130551u
+#define NK_TYCHE_DISCARD 20
+
+static inline NK_TYCHE_CONSTEXPR uint32_t nk_tyche_rotl32(uint32_t x, int k)
+{
+    return (x << k) | (x >> (32 - k));
+}
+
+static inline NK_TYCHE_CONSTEXPR uint32_t nk_tyche_next(uint32_t s[4])
+{
+    s[0] += s[1]; s[3] = nk_tyche_rotl32(s[3] ^ s[0], 16);
+    s[2] += s[3]; s[1] = nk_tyche_rotl32(s[1] ^ s[2], 12);
+    s[0] += s[1]; s[3] = nk_tyche_rotl32(s[3] ^ s[0], 8);
+    s[2] += s[3]; s[1] = nk_tyche_rotl32(s[1] ^ s[2], 7);
+    return s[1];
+}
+
+// Seeds s from a 64-bit seed and a stream index, as described in the paper.
+static inline NK_TYCHE_CONSTEXPR void nk_tyche_seed(uint32_t s[4], uint64_t seed,
+                                                    uint32_t idx)
+{
+    s[0] = (uint32_t)(seed >> 32);
+    s[1] = (uint32_t)seed;
+    s[2] = NK_TYCHE_SEED2;
+    s[3] = NK_TYCHE_SEED3 ^ idx;
+    for (int i = 0; i < NK_TYCHE_DISCARD; ++i) (void)nk_tyche_next(s);
+}
+
 struct nk_random_state {
     uint32_t seed[4];
 };
 
 void nk_random_init(struct nk_random_state *s);
+void nk_random_init_seed(struct nk_random_state *s, uint64_t seed,
+                         uint32_t idx);
 uint32_t nk_random_u32(struct nk_random_state *s);
 static inline uint64_t nk_random_u64(struct nk_random_state *s)
 {
@@ -42,6 +88,26 @@ static inline uint64_t nk_random_u64(struct nk_random_state *s)
     const uint64_t lo = nk_random_u32(s);
     return (hi << 32) | lo;
 }
+// Unbiased integer in [0, range) via Lemire's multiply-shift method; use
+// this rather than nk_random_u32(s) % range.  range must be > 0.
+static inline uint32_t nk_random_bounded(struct nk_random_state *s,
+                                         uint32_t range)
+{
+    uint64_t m = (uint64_t)nk_random_u32(s) * range;
+    uint32_t l = (uint32_t)m;
+    if (l < range) {
+        const uint32_t t = -range % range;
+        while (l < t) {
+            m = (uint64_t)nk_random_u32(s) * range;
+            l = (uint32_t)m;
+        }
+    }
+    return (uint32_t)(m >> 32);
+}
+// Uniform double in [0, 1).
+static inline double nk_random_double(struct nk_random_state *s)
+{
+    return (double)(nk_random_u64(s) >> 11) * 0x1.0p-53;
+}
 
 #endif
-
@@ -0,0 +1,54 @@
+/* random_tls.h - fork-safe per-thread random generators
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef NCMLIB_RANDOM_TLS_H_
+#define NCMLIB_RANDOM_TLS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Managed per-thread Tyche and ChaCha20 generators that need no explicit
+// initialization and are safe across fork().
+//
+// Each thread's state lives in its own page that is marked
+// MADV_WIPEONFORK, so the kernel zeroes it in a forked child and the next
+// call lazily reseeds from nk_get_hwrng().  On kernels without
+// MADV_WIPEONFORK (< 4.14), a pthread_atfork() child handler clears the
+// state of the forking thread instead.  Either way, parent and child never
+// emit the same stream, and no fork detection happens on the call path.
+// The page is also excluded from core dumps and is wiped and unmapped
+// when the thread exits.
+
+uint32_t nk_random_tls_u32(void);
+uint64_t nk_random_tls_u64(void);
+uint32_t nk_random_tls_bounded(uint32_t range);
+
+void nk_csprng_tls_get(void *out, size_t len);
+uint32_t nk_csprng_tls_u32(void);
+uint64_t nk_csprng_tls_u64(void);
+
+#endif
@@ -0,0 +1,105 @@
+/* supervise.h - pidfd-based child supervision
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NCM_SUPERVISE_H_
+#define NCM_SUPERVISE_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include "nk/exec.h"
+
+// Watches child processes through pidfds (Linux >= 5.4) rather than
+// SIGCHLD and waitpid().  All pidfds, and a timerfd that drives delayed
+// restarts, are registered with a single epoll fd that nk_supervisor_fd()
+// exposes, so it can be added to the caller's event loop; when it becomes
+// readable, nk_supervisor_wait() collects exit status and rusage with
+// waitid(P_PIDFD) for just the children that exited.
+//
+// Children may be spawned by the supervisor, in which case they may be
+// restarted according to a nk_restart_opts, or adopted with
+// nk_supervisor_watch() (for example, children launched by a zygote).
+//
+// A supervisor is not thread-safe.
+
+enum nk_restart_policy {
+    NK_RESTART_NEVER,
+    NK_RESTART_ON_FAILURE, // unless exited with status 0
+    NK_RESTART_ALWAYS,
+};
+
+// The first restart happens after delay_ms; each following one doubles the
+// delay up to max_delay_ms.  A child that ran for at least reset_ms has
+// its delay reset.  max_restarts of 0 means no limit.
+struct nk_restart_opts {
+    int policy;
+    unsigned delay_ms;
+    unsigned max_delay_ms;
+    unsigned reset_ms;
+    unsigned max_restarts;
+};
+
+enum nk_child_event_type {
+    NK_CHILD_EXITED,         // code, status and rusage are set
+    NK_CHILD_RESTARTED,      // pid is the new process
+    NK_CHILD_RESTART_FAILED, // err is set
+};
+
+struct nk_supervisor;
+struct nk_child;
+
+struct nk_child_event {
+    int type;
+    struct nk_child *child;
+    void *ctx;
+    pid_t pid;
+    int code;   // CLD_EXITED, CLD_KILLED or CLD_DUMPED
+    int status; // exit status or signal number
+    int err;
+    struct rusage rusage;
+    // No further events will be reported for child, and the handle is no
+    // longer valid.
+    bool final;
+};
+
+struct nk_supervisor *nk_supervisor_new(void);
+void nk_supervisor_free(struct nk_supervisor *sv, int sig);
+int nk_supervisor_fd(const struct nk_supervisor *sv);
+int nk_supervisor_spawn(struct nk_supervisor *sv, struct nk_child **child,
+                        const struct nk_command *cmd, char * const envp[],
+                        const struct nk_spawn_opts *opts,
+                        const struct nk_restart_opts *ropts, void *ctx);
+int nk_supervisor_watch(struct nk_supervisor *sv, struct nk_child **child,
+                        pid_t pid, int pidfd, void *ctx);
+int nk_supervisor_signal(struct nk_child *child, int sig);
+void nk_supervisor_forget(struct nk_supervisor *sv, struct nk_child *child);
+pid_t nk_child_pid(const struct nk_child *child);
+int nk_supervisor_wait(struct nk_supervisor *sv, struct nk_child_event *ev,
+                       size_t n, int timeout_ms);
+
+#endif
@@ -7,6 +7,7 @@
 #include <tuple>
 extern "C" {
 #include <nk/hwrng.h>
+#include <nk/random.h>
 }
 
 namespace nk::rng {
@@ -15,11 +16,12 @@ namespace nk::rng {
 // Passes BigCrush, designed to be easy to split via the index parameter.
 // https://eden.dei.uc.pt/~sneves/pubs/2011-snfa2.pdf
 // Roughly comparable in speed to PCG64, xorshift1024m, or speckrng-10.
+//
+// The round function is shared with the C nk_random_* API in nk/random.h,
+// so tyche(seed, idx) and nk_random_init_seed(s, seed, idx) emit the
+// same stream, and state can be converted between the two.
 
 namespace detail {
-    static inline uint64_t rotl(const uint64_t x, int k) {
-        return (x << k) | (x >> (64 - k));
-    }
     template <typename T>
     static inline T nk_get_hwrng_v() {
         T r;
@@ -31,23 +33,18 @@ namespace detail {
 struct tyche final
 {
     typedef std::uint32_t result_type;
-    tyche(uint64_t s, uint32_t idx) noexcept
-        : s_{ static_cast<uint32_t>(s >> 32), static_cast<uint32_t>(s), 2654435769, 1367130551 ^ idx } { discard(20); }
+    constexpr tyche(uint64_t s, uint32_t idx) noexcept : s_{} { nk_tyche_seed(s_, s, idx); }
     tyche(uint32_t idx = 0) : tyche(detail::nk_get_hwrng_v<uint64_t>(), idx) {}
-    tyche(uint32_t a, uint32_t b, uint32_t c, uint32_t d) noexcept : s_{ a, b, c, d } {}
+    constexpr tyche(uint32_t a, uint32_t b, uint32_t c, uint32_t d) noexcept : s_{ a, b, c, d } {}
+    explicit constexpr tyche(const nk_random_state &s) noexcept
+        : s_{ s.seed[0], s.seed[1], s.seed[2], s.seed[3] } {}
 
     std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> seed() const { return std::make_tuple(s_[0], s_[1], s_[2], s_[3]); }
     void seed(uint32_t a, uint32_t b, uint32_t c, uint32_t d) noexcept { s_[0] = a; s_[1] = b; s_[2] = c; s_[3] = d; }
+    constexpr nk_random_state state() const noexcept { return nk_random_state{ { s_[0], s_[1], s_[2], s_[3] } }; }
 
-    inline uint32_t operator()() noexcept
-    {
-        s_[0] += s_[1]; s_[3] = detail::rotl(s_[3] ^ s_[0], 16);
-        s_[2] += s_[3]; s_[1] = detail::rotl(s_[1] ^ s_[2], 12);
-        s_[0] += s_[1]; s_[3] = detail::rotl(s_[3] ^ s_[0], 8);
-        s_[2] += s_[3]; s_[1] = detail::rotl(s_[1] ^ s_[2], 7);
-        return s_[1];
-    }
-    void discard(size_t z) noexcept { while (z-- > 0) operator()(); }
+    constexpr uint32_t operator()() noexcept { return nk_tyche_next(s_); }
+    constexpr void discard(size_t z) noexcept { while (z-- > 0) operator()(); }
     static constexpr uint32_t min() noexcept { return 0u; }
     static constexpr uint32_t max() noexcept { return ~0u; }
     static constexpr size_t state_size = sizeof(uint64_t);
@@ -61,6 +58,20 @@ inline constexpr bool operator==(const tyche &a, const tyche &b) noexcept {
 }
 inline constexpr bool operator!=(const tyche &a, const tyche &b) noexcept { return !operator==(a, b); }
 
+namespace detail {
+    // Known-answer vectors; the same values are produced by
+    // nk_random_init_seed() followed by nk_random_u32().
+    constexpr bool tyche_kat(uint64_t seed, uint32_t idx, uint32_t a, uint32_t b,
+                             uint32_t c, uint32_t d) {
+        tyche t(seed, idx);
+        return t() == a && t() == b && t() == c && t() == d;
+    }
+    static_assert(tyche_kat(0, 0, 0x02e5d39du, 0x41484fe0u, 0x89fe8430u, 0xe7aa9e3au));
+    static_assert(tyche_kat(0, 1, 0x99b9661au, 0x783f1b3au, 0xd88a948du, 0x0f64a4fcu));
+    static_assert(tyche_kat(0x0123456789abcdefu, 0, 0x93fdb15bu, 0x24ec7ed0u, 0x40951c12u, 0x0b939b48u));
+    static_assert(tyche_kat(0x0123456789abcdefu, 1, 0x13c4a28au, 0xb4ae9ce2u, 0x2f2675b6u, 0xa667f11cu));
+}
+
 }
 
 #endif
@@ -0,0 +1,196 @@
+#ifndef NCMLIB_RNG_TYCHE_DIST_HPP_
+#define NCMLIB_RNG_TYCHE_DIST_HPP_
+
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <nk/tyche.hpp>
+
+namespace nk::rng {
+
+// Distributions for 32-bit generators such as tyche.  Unlike the std::
+// distributions, the output for a given generator state is fixed by this
+// code and does not vary between standard library implementations.
+//
+// bounded() uses Lemire's multiply-shift method, which is unbiased and
+// usually needs no division:
+//   D. Lemire, "Fast Random Integer Generation in an Interval", 2019.
+// exponential() and normal() use the ziggurat method:
+//   G. Marsaglia and W. W. Tsang, "The Ziggurat Method for Generating
+//   Random Variables", 2000.
+// The layer index is taken from bits that are masked out of the value, so
+// the two are independent (see J. A. Doornik, "An Improved Ziggurat
+// Method to Generate Normal Random Samples", 2005).
+
+// Returns a uniformly distributed integer in [0, range).  range must be > 0.
+template <typename G>
+inline uint32_t bounded(G &g, uint32_t range) noexcept
+{
+    uint64_t m = static_cast<uint64_t>(g()) * range;
+    uint32_t l = static_cast<uint32_t>(m);
+    if (l < range) {
+        const uint32_t t = -range % range;
+        while (l < t) {
+            m = static_cast<uint64_t>(g()) * range;
+            l = static_cast<uint32_t>(m);
+        }
+    }
+    return static_cast<uint32_t>(m >> 32);
+}
+
+// Returns a uniformly distributed integer in [lo, hi].
+template <typename G>
+inline uint32_t uniform(G &g, uint32_t lo, uint32_t hi) noexcept
+{
+    const uint32_t range = hi - lo + 1;
+    return range ? lo + bounded(g, range) : g();
+}
+
+constexpr float to_float(uint32_t x) noexcept { return (x >> 8) * 0x1.0p-24f; }
+constexpr double to_double(uint64_t x) noexcept { return (x >> 11) * 0x1.0p-53; }
+
+// Uniform in [0, 1).
+template <typename G>
+inline float uniform_float(G &g) noexcept { return to_float(g()); }
+template <typename G>
+inline double uniform_double(G &g) noexcept
+{
+    const uint64_t hi = g();
+    return to_double((hi << 32) | g());
+}
+
+namespace detail {
+    // Uniform in (0, 1); suitable as an argument to log().
+    template <typename G>
+    inline double uniform_open(G &g) noexcept
+    {
+        const uint64_t hi = g();
+        return (static_cast<double>(((hi << 32) | g()) >> 11) + 0.5) * 0x1.0p-53;
+    }
+
+    struct ziggurat_tables {
+        static constexpr double nr = 3.442619855899, nv = 9.91256303526217e-3;
+        static constexpr double er = 7.697117470131487, ev = 3.949659822581572e-3;
+        uint32_t kn[128]; double wn[128], fn[128];
+        uint32_t ke[256]; double we[256], fe[256];
+
+        ziggurat_tables() noexcept
+        {
+            const double m1 = 2147483648.0, m2 = 4294967296.0;
+            double dn = nr, tn = dn, q = nv / std::exp(-0.5 * dn * dn);
+            kn[0] = static_cast<uint32_t>((dn / q) * m1);
+            kn[1] = 0;
+            wn[0] = q / m1;
+            wn[127] = dn / m1;
+            fn[0] = 1.0;
+            fn[127] = std::exp(-0.5 * dn * dn);
+            for (int i = 126; i >= 1; --i) {
+                dn = std::sqrt(-2.0 * std::log(nv / dn + std::exp(-0.5 * dn * dn)));
+                kn[i + 1] = static_cast<uint32_t>((dn / tn) * m1);
+                tn = dn;
+                fn[i] = std::exp(-0.5 * dn * dn);
+                wn[i] = dn / m1;
+            }
+            double de = er, te = de;
+            q = ev / std::exp(-de);
+            ke[0] = static_cast<uint32_t>((de / q) * m2);
+            ke[1] = 0;
+            we[0] = q / m2;
+            we[255] = de / m2;
+            fe[0] = 1.0;
+            fe[255] = std::exp(-de);
+            for (int i = 254; i >= 1; --i) {
+                de = -std::log(ev / de + std::exp(-de));
+                ke[i + 1] = static_cast<uint32_t>((de / te) * m2);
+                te = de;
+                fe[i] = std::exp(-de);
+                we[i] = de / m2;
+            }
+        }
+        static const ziggurat_tables &get() noexcept
+        {
+            static const ziggurat_tables t;
+            return t;
+        }
+    };
+}
+
+// Standard exponential distribution (rate 1).
+template <typename G>
+inline double exponential(G &g) noexcept
+{
+    const auto &z = detail::ziggurat_tables::get();
+    for (;;) {
+        const uint32_t u = g();
+        const uint32_t i = u & 255;
+        const uint32_t j = u & ~255u;
+        const double x = j * z.we[i];
+        if (j < z.ke[i])
+            return x;
+        if (i == 0)
+            return z.er - std::log(detail::uniform_open(g));
+        if (z.fe[i] + detail::uniform_open(g) * (z.fe[i - 1] - z.fe[i]) < std::exp(-x))
+            return x;
+    }
+}
+
+// Standard normal distribution (mean 0, standard deviation 1).
+template <typename G>
+inline double normal(G &g) noexcept
+{
+    const auto &z = detail::ziggurat_tables::get();
+    for (;;) {
+        const uint32_t u = g();
+        const uint32_t i = u & 127;
+        const int32_t j = static_cast<int32_t>(u & ~127u);
+        const double x = j * z.wn[i];
+        const uint32_t aj = j < 0 ? -static_cast<uint32_t>(j) : static_cast<uint32_t>(j);
+        if (aj < z.kn[i])
+            return x;
+        if (i == 0) {
+            double xt, yt;
+            do {
+                xt = -std::log(detail::uniform_open(g)) / z.nr;
+                yt = -std::log(detail::uniform_open(g));
+            } while (yt + yt < xt * xt);
+            return j > 0 ? z.nr + xt : -z.nr - xt;
+        }
+        if (z.fn[i] + detail::uniform_open(g) * (z.fn[i - 1] - z.fn[i]) < std::exp(-0.5 * x * x))
+            return x;
+    }
+}
+
+template <typename G>
+inline double normal(G &g, double mean, double stddev) noexcept { return mean + stddev * normal(g); }
+
+// Batch forms that fill out[0..n).
+template <typename G>
+inline void fill_bounded(G &g, uint32_t *out, size_t n, uint32_t range) noexcept
+{
+    for (size_t i = 0; i < n; ++i) out[i] = bounded(g, range);
+}
+template <typename G>
+inline void fill_uniform(G &g, float *out, size_t n) noexcept
+{
+    for (size_t i = 0; i < n; ++i) out[i] = uniform_float(g);
+}
+template <typename G>
+inline void fill_uniform(G &g, double *out, size_t n) noexcept
+{
+    for (size_t i = 0; i < n; ++i) out[i] = uniform_double(g);
+}
+template <typename G>
+inline void fill_exponential(G &g, double *out, size_t n) noexcept
+{
+    for (size_t i = 0; i < n; ++i) out[i] = exponential(g);
+}
+template <typename G>
+inline void fill_normal(G &g, double *out, size_t n) noexcept
+{
+    for (size_t i = 0; i < n; ++i) out[i] = normal(g);
+}
+
+}
+
+#endif
+
@@ -0,0 +1,67 @@
+#ifndef NCMLIB_RNG_TYCHE_STREAM_HPP_
+#define NCMLIB_RNG_TYCHE_STREAM_HPP_
+
+#include <cstdint>
+#include <atomic>
+#include <nk/tyche.hpp>
+
+namespace nk::rng {
+
+// Derives independent Tyche streams from a single master seed.
+//
+// Stream n is seeded with splitmix64(master, n) and uses n as its Tyche
+// index, so two streams from the same factory never start from the same
+// state.  Tyche has no jump function, so non-overlap is probabilistic;
+// with 2^64 seeds and a period far larger than any practical run length,
+// the chance of two streams overlapping is negligible.
+//
+// global() is seeded by exactly one nk_get_hwrng() call per process, and
+// local() returns a per-thread generator that is lazily drawn from it on
+// first use, so starting many worker threads does not cost one getrandom
+// syscall per thread.
+
+namespace detail {
+    constexpr uint64_t splitmix64(uint64_t x) noexcept {
+        x += 0x9e3779b97f4a7c15u;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9u;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebu;
+        return x ^ (x >> 31);
+    }
+}
+
+class stream_factory final
+{
+public:
+    explicit stream_factory(uint64_t master) noexcept : master_(master), next_(0) {}
+    stream_factory() : stream_factory(detail::nk_get_hwrng_v<uint64_t>()) {}
+    stream_factory(const stream_factory &) = delete;
+    stream_factory &operator=(const stream_factory &) = delete;
+
+    // Returns a generator for the next unused stream.  Thread-safe.
+    tyche make() noexcept { return at(next_.fetch_add(1, std::memory_order_relaxed)); }
+    // Returns the generator for stream n; does not consume a stream.
+    constexpr tyche at(uint64_t n) const noexcept {
+        return tyche(detail::splitmix64(master_ ^ detail::splitmix64(n)),
+                     static_cast<uint32_t>(n));
+    }
+    uint64_t master_seed() const noexcept { return master_; }
+    uint64_t streams_issued() const noexcept { return next_.load(std::memory_order_relaxed); }
+
+    static stream_factory &global() {
+        static stream_factory f;
+        return f;
+    }
+    // Per-thread generator, drawn from global() on first use in each thread.
+    static tyche &local() {
+        thread_local tyche t = global().make();
+        return t;
+    }
+private:
+    const uint64_t master_;
+    std::atomic<uint64_t> next_;
+};
+
+}
+
+#endif
+
@@ -0,0 +1,72 @@
+/* zygote.h - pre-forked process launcher
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef NCM_ZYGOTE_H_
+#define NCM_ZYGOTE_H_
+
+#include <sys/types.h>
+
+// A zygote is a small helper process, forked once, that launches commands
+// on request.  It resolves credentials and the environment once at
+// startup and then serves spawn requests over unix sockets, so each launch
+// costs neither a fork of the (possibly large) caller nor any NSS lookups.
+//
+// Children are created with nk_spawn() using NK_SPAWN_F_SIBLING, so they
+// are children of the process that started the zygote: it receives
+// SIGCHLD for them and reaps them as usual.  A pidfd for each child is
+// passed back with SCM_RIGHTS.
+//
+// Each connection serves one request at a time.  Threads that launch
+// concurrently should each obtain their own connection with
+// nk_zygote_connect(); the zygote multiplexes all connections.
+//
+// The zygote exits once z->fd is closed, by nk_zygote_stop() or by the
+// exit of the process that started it.  The fd is close-on-exec, but a
+// child forked without exec keeps it, and with it the zygote, alive.
+
+struct nk_zygote_config {
+    uid_t uid;              // credentials of children; -1 leaves unchanged
+    gid_t gid;
+    const char *chroot_path;  // chroot of the zygote and its children
+    const char *path_var;   // PATH for nk_generate_env(), or NULL
+    // If envp is NULL, the environment is built by nk_generate_env() for
+    // uid; otherwise envp is copied into the zygote and used as is.
+    char * const *envp;
+};
+
+struct nk_zygote {
+    pid_t pid;
+    int fd;
+};
+
+int nk_zygote_start(struct nk_zygote *z, const struct nk_zygote_config *cfg);
+int nk_zygote_connect(int fd, int *newfd);
+int nk_zygote_spawn(int fd, const char *command, const char *args,
+                    pid_t *pid, int *pidfd);
+void nk_zygote_stop(struct nk_zygote *z);
+
+#endif
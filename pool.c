@@ -0,0 +1,281 @@
+/* pool.c - fixed-size object pools
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "nk/pool.h"
+#include "nk/malloc.h"
+#include "nk/log.h"
+
+#define NK_POOL_SLAB (64 * 1024)
+#define NK_POOL_LINE 64
+#ifndef MPOL_LOCAL
+#define MPOL_LOCAL 4
+#endif
+
+// Free objects are chained through their first word.  Full batches in
+// the depot are chained through the second word of their first object.
+struct nk_pool_node {
+    struct nk_pool_node *next;
+    struct nk_pool_node *next_batch;
+};
+
+struct nk_pool_slab {
+    struct nk_pool_slab *next;
+    size_t len;
+};
+
+struct nk_pool_cache {
+    struct nk_pool *pool;
+    struct nk_pool_cache *prev, *next;
+    struct nk_pool_node *head;
+    size_t n;
+};
+
+struct nk_pool {
+    pthread_key_t key;
+    pthread_mutex_t lock;
+    size_t size;
+    size_t align;
+    unsigned flags;
+    // Protected by lock:
+    struct nk_pool_node *batches; // full batches of NK_POOL_BATCH objects
+    struct nk_pool_node *loose;   // objects flushed by exiting threads
+    char *pos, *end;              // not yet carved part of the newest slab
+    struct nk_pool_slab *slabs;
+    struct nk_pool_cache *caches;
+};
+
+// Runs at thread exit: hands the thread's cached objects back to the depot.
+static void nk_pool_cache_release(void *arg)
+{
+    struct nk_pool_cache *c = arg;
+    struct nk_pool *p = c->pool;
+    pthread_mutex_lock(&p->lock);
+    if (c->head) {
+        struct nk_pool_node *t = c->head;
+        while (t->next) t = t->next;
+        t->next = p->loose;
+        p->loose = c->head;
+    }
+    if (c->prev) c->prev->next = c->next;
+    else p->caches = c->next;
+    if (c->next) c->next->prev = c->prev;
+    pthread_mutex_unlock(&p->lock);
+    free(c);
+}
+
+// Size of the slab header, rounded so that the first object is aligned.
+static size_t nk_pool_slab_hdr(size_t align)
+{
+    return (sizeof(struct nk_pool_slab) + align - 1) & ~(align - 1);
+}
+
+// Creates a pool of objects of at least size bytes.  Exits via suicide()
+// on failure.
+struct nk_pool *nk_pool_new(size_t size, unsigned flags)
+{
+    struct nk_pool *p = xmalloc(sizeof *p);
+    memset(p, 0, sizeof *p);
+    p->flags = flags;
+    p->align = flags & NK_POOL_ALIGNED ? NK_POOL_LINE : 16;
+    if (size < sizeof(struct nk_pool_node))
+        size = sizeof(struct nk_pool_node);
+    if (size > NK_POOL_SLAB - nk_pool_slab_hdr(p->align))
+        suicide("%s: object size %zu is too large", __func__, size);
+    p->size = (size + p->align - 1) & ~(p->align - 1);
+    if (p->size > NK_POOL_SLAB - nk_pool_slab_hdr(p->align))
+        suicide("%s: object size %zu is too large", __func__, size);
+    int r = pthread_key_create(&p->key, nk_pool_cache_release);
+    if (r)
+        suicide("%s: pthread_key_create failed: %s", __func__, strerror(r));
+    pthread_mutex_init(&p->lock, NULL);
+    return p;
+}
+
+static void nk_pool_free_slab(const struct nk_pool *p, struct nk_pool_slab *s)
+{
+    if (p->flags & NK_POOL_NUMA)
+        munmap(s, s->len);
+    else
+        free(s);
+}
+
+// Frees the pool and all of its memory.  No other thread may be using the
+// pool, and objects taken from it must no longer be used.
+void nk_pool_destroy(struct nk_pool *p)
+{
+    if (!p)
+        return;
+    pthread_key_delete(p->key);
+    for (struct nk_pool_cache *c = p->caches, *n; c; c = n) {
+        n = c->next;
+        free(c);
+    }
+    for (struct nk_pool_slab *s = p->slabs, *n; s; s = n) {
+        n = s->next;
+        nk_pool_free_slab(p, s);
+    }
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+size_t nk_pool_object_size(const struct nk_pool *p)
+{
+    return p->size;
+}
+
+static void nk_pool_new_slab(struct nk_pool *p)
+{
+    const size_t len = NK_POOL_SLAB;
+    void *m;
+    if (p->flags & NK_POOL_NUMA) {
+        m = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED)
+            suicide("%s: mmap failed: %s", __func__, strerror(errno));
+#if defined(__linux__) && defined(SYS_mbind)
+        // Fails harmlessly on kernels without NUMA support.
+        syscall(SYS_mbind, m, len, MPOL_LOCAL, NULL, 0, 0);
+#endif
+    } else {
+        int r = posix_memalign(&m, NK_POOL_LINE, len);
+        if (r)
+            suicide("%s: posix_memalign failed: %s", __func__, strerror(r));
+    }
+    struct nk_pool_slab *s = m;
+    s->len = len;
+    s->next = p->slabs;
+    p->slabs = s;
+    p->pos = (char *)m + nk_pool_slab_hdr(p->align);
+    p->end = (char *)m + len;
+}
+
+// Fills an empty cache with up to NK_POOL_BATCH objects from the depot,
+// carving a new slab if the depot is empty.
+static void nk_pool_refill(struct nk_pool *p, struct nk_pool_cache *c)
+{
+    pthread_mutex_lock(&p->lock);
+    if (p->batches) {
+        c->head = p->batches;
+        p->batches = c->head->next_batch;
+        c->n = NK_POOL_BATCH;
+    } else if (p->loose) {
+        struct nk_pool_node *t = p->loose;
+        size_t n = 1;
+        while (n < NK_POOL_BATCH && t->next) {
+            t = t->next;
+            ++n;
+        }
+        c->head = p->loose;
+        p->loose = t->next;
+        t->next = NULL;
+        c->n = n;
+    } else {
+        if ((size_t)(p->end - p->pos) < p->size)
+            nk_pool_new_slab(p);
+        size_t n = (size_t)(p->end - p->pos) / p->size;
+        if (n > NK_POOL_BATCH) n = NK_POOL_BATCH;
+        if (!n)
+            suicide("%s: slab holds no objects of size %zu", __func__, p->size);
+        char *o = p->pos;
+        for (size_t i = 0; i + 1 < n; ++i)
+            ((struct nk_pool_node *)(o + i * p->size))->next =
+                (struct nk_pool_node *)(o + (i + 1) * p->size);
+        ((struct nk_pool_node *)(o + (n - 1) * p->size))->next = NULL;
+        p->pos += n * p->size;
+        c->head = (struct nk_pool_node *)o;
+        c->n = n;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+static struct nk_pool_cache *nk_pool_get_cache(struct nk_pool *p)
+{
+    struct nk_pool_cache *c = pthread_getspecific(p->key);
+    if (c)
+        return c;
+    c = xmalloc(sizeof *c);
+    memset(c, 0, sizeof *c);
+    c->pool = p;
+    pthread_mutex_lock(&p->lock);
+    c->next = p->caches;
+    if (p->caches) p->caches->prev = c;
+    p->caches = c;
+    pthread_mutex_unlock(&p->lock);
+    int r = pthread_setspecific(p->key, c);
+    if (r)
+        suicide("%s: pthread_setspecific failed: %s", __func__, strerror(r));
+    return c;
+}
+
+void *nk_pool_get(struct nk_pool *p)
+{
+    struct nk_pool_cache *c = nk_pool_get_cache(p);
+    if (!c->head)
+        nk_pool_refill(p, c);
+    struct nk_pool_node *o = c->head;
+    c->head = o->next;
+    --c->n;
+    return o;
+}
+
+// Returns obj to the pool.  Once the cache holds two batches, one is
+// moved to the depot, so a thread that only frees does not hoard objects.
+void nk_pool_put(struct nk_pool *p, void *obj)
+{
+    struct nk_pool_cache *c = nk_pool_get_cache(p);
+    struct nk_pool_node *o = obj;
+    o->next = c->head;
+    c->head = o;
+    if (++c->n < 2 * NK_POOL_BATCH)
+        return;
+    struct nk_pool_node *t = c->head;
+    for (size_t i = 1; i < NK_POOL_BATCH; ++i)
+        t = t->next;
+    struct nk_pool_node *b = c->head;
+    c->head = t->next;
+    t->next = NULL;
+    c->n -= NK_POOL_BATCH;
+    pthread_mutex_lock(&p->lock);
+    b->next_batch = p->batches;
+    p->batches = b;
+    pthread_mutex_unlock(&p->lock);
+}
@@ -31,12 +31,15 @@
 #endif
 
 #include <unistd.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <pwd.h>
 #include <grp.h>
 #ifdef __linux__
@@ -45,6 +48,8 @@
 #endif
 #include "nk/privilege.h"
 #include "nk/log.h"
+#include "nk/malloc.h"
+#include "nk/credcache.h"
 
 void nk_set_chroot(const char *chroot_dir)
 {
@@ -128,6 +133,20 @@ static void nk_set_capability_epilogue(const unsigned char *caps,
 { (void)caps; (void)caplen; (void)cversion; (void)csize; }
 #endif
 
+// Locks all current and future pages into memory so that page faults
+// never stall the process.  Call while still privileged, before
+// nk_set_uidgid(): without CAP_IPC_LOCK, mappings made later count
+// against RLIMIT_MEMLOCK and fail once it is reached, so the limit is
+// raised first if CAP_SYS_RESOURCE allows.
+void nk_lock_memory(void)
+{
+    const struct rlimit rl = { RLIM_INFINITY, RLIM_INFINITY };
+    if (setrlimit(RLIMIT_MEMLOCK, &rl) && errno != EPERM)
+        suicide("%s: setrlimit failed: %s", __func__, strerror(errno));
+    if (mlockall(MCL_CURRENT | MCL_FUTURE))
+        suicide("%s: mlockall failed: %s", __func__, strerror(errno));
+}
+
 #ifdef NK_USE_NO_NEW_PRIVS
 static void nk_set_no_new_privs(void)
 {
@@ -166,32 +185,67 @@ void nk_set_uidgid(uid_t uid, gid_t gid, const unsigned char *caps,
     nk_set_no_new_privs();
 }
 
+// Parses a decimal uid or gid.  Returns false if s is not one.
+static bool nk_parse_id(const char *s, unsigned long *id)
+{
+    for (size_t i = 0; s[i]; ++i) {
+        if (!isdigit(s[i]))
+            return false;
+    }
+    char *p;
+    errno = 0;
+    long lt = strtol(s, &p, 10);
+    if (errno == ERANGE && (lt == LONG_MIN || lt == LONG_MAX))
+        return false;
+    if (lt < 0 || lt > (long)UINT_MAX)
+        return false;
+    if (p == s)
+        return false;
+    *id = (unsigned long)lt;
+    return true;
+}
+
+// Lookups try the credential cache first and fall back to NSS for
+// entries that it does not hold, unless it reads the files directly.
 uid_t nk_uidgidbyname(const char *username, uid_t *uid, gid_t *gid)
 {
     if (!username)
         return (uid_t)-1;
-    struct passwd *pws = getpwnam(username);
-    if (!pws) {
-        for (size_t i = 0; username[i]; ++i) {
-            if (!isdigit(username[i]))
+    const struct nk_cred_user *cu = nk_cred_user_byname(username);
+    if (!cu) {
+        unsigned long id;
+        bool numeric = nk_parse_id(username, &id);
+        if (numeric)
+            cu = nk_cred_user_byuid((uid_t)id);
+        if (!cu && nk_credcache_files_only())
+            return (uid_t)-1;
+        if (!cu) {
+            size_t buflen = 4096;
+            char *buf = xmalloc(buflen);
+            struct passwd pw, *pws = NULL;
+            int r;
+            while ((r = getpwnam_r(username, &pw, buf, buflen, &pws)) == ERANGE)
+                buf = xrealloc(buf, buflen *= 2);
+            if ((r || !pws) && numeric) {
+                while ((r = getpwuid_r((uid_t)id, &pw, buf, buflen, &pws)) == ERANGE)
+                    buf = xrealloc(buf, buflen *= 2);
+            }
+            uid_t u = pws ? pws->pw_uid : 0;
+            gid_t g = pws ? pws->pw_gid : 0;
+            free(buf);
+            if (r || !pws)
                 return (uid_t)-1;
+            if (gid)
+                *gid = g;
+            if (uid)
+                *uid = u;
+            return (uid_t)0;
         }
-        char *p;
-        long lt = strtol(username, &p, 10);
-        if (errno == ERANGE && (lt == LONG_MIN || lt == LONG_MAX))
-            return (uid_t)-1;
-        if (lt < 0 || lt > (long)UINT_MAX)
-            return (uid_t)-1;
-        if (p == username)
-            return (uid_t)-1;
-        pws = getpwuid((uid_t)lt);
-        if (!pws)
-            return (uid_t)-1;
     }
     if (gid)
-        *gid = pws->pw_gid;
+        *gid = cu->gid;
     if (uid)
-        *uid = pws->pw_uid;
+        *uid = cu->uid;
     return (uid_t)0;
 }
 
@@ -199,26 +253,37 @@ gid_t nk_gidbyname(const char *groupname, gid_t *gid)
 {
     if (!groupname)
         return (gid_t)-1;
-    struct group *grp = getgrnam(groupname);
-    if (!grp) {
-        for (size_t i = 0; groupname[i]; ++i) {
-            if (!isdigit(groupname[i]))
+    const struct nk_cred_group *cg = nk_cred_group_byname(groupname);
+    if (!cg) {
+        unsigned long id;
+        bool numeric = nk_parse_id(groupname, &id);
+        if (numeric)
+            cg = nk_cred_group_bygid((gid_t)id);
+        if (!cg && nk_credcache_files_only())
+            return (gid_t)-1;
+        if (!cg) {
+            // Member lists make group entries large; grow the buffer on
+            // ERANGE.
+            size_t buflen = 4096;
+            char *buf = xmalloc(buflen);
+            struct group gr, *grp = NULL;
+            int r;
+            while ((r = getgrnam_r(groupname, &gr, buf, buflen, &grp)) == ERANGE)
+                buf = xrealloc(buf, buflen *= 2);
+            if ((r || !grp) && numeric) {
+                while ((r = getgrgid_r((gid_t)id, &gr, buf, buflen, &grp)) == ERANGE)
+                    buf = xrealloc(buf, buflen *= 2);
+            }
+            gid_t g = grp ? grp->gr_gid : 0;
+            free(buf);
+            if (r || !grp)
                 return (gid_t)-1;
+            if (gid)
+                *gid = g;
+            return (gid_t)0;
         }
-        char *p;
-        long lt = strtol(groupname, &p, 10);
-        if (errno == ERANGE && (lt == LONG_MIN || lt == LONG_MAX))
-            return (gid_t)-1;
-        if (lt < 0 || lt > (long)UINT_MAX)
-            return (gid_t)-1;
-        if (p == groupname)
-            return (gid_t)-1;
-        grp = getgrgid((gid_t)lt);
-        if (!grp)
-            return (gid_t)-1;
     }
     if (gid)
-        return grp->gr_gid;
+        *gid = cg->gid;
     return (gid_t)0;
 }
-
@@ -30,26 +30,20 @@
 #include "nk/hwrng.h"
 #include "nk/random.h"
 
-// Tyche PRNG: https://eden.dei.uc.pt/~sneves/pubs/2011-snfa2.pdf
-
 void nk_random_init(struct nk_random_state *s)
 {
-    nk_get_hwrng(s->seed, sizeof(uint32_t) * 2);
-    s->seed[2] = 2654435769;
-    s->seed[3] = 1367130551;
-    for (unsigned i = 0; i < 20; ++i) (void)nk_random_u32(s);
+    uint64_t seed;
+    nk_get_hwrng(&seed, sizeof seed);
+    nk_tyche_seed(s->seed, seed, 0);
 }
 
-static inline uint32_t rotl32(const uint32_t x, int k) {
-    return (x << k) | (x >> (32 - k));
+void nk_random_init_seed(struct nk_random_state *s, uint64_t seed,
+                         uint32_t idx)
+{
+    nk_tyche_seed(s->seed, seed, idx);
 }
 
 uint32_t nk_random_u32(struct nk_random_state *s)
 {
-    s->seed[0] += s->seed[1]; s->seed[3] = rotl32(s->seed[3] ^ s->seed[0], 16);
-    s->seed[2] += s->seed[3]; s->seed[1] = rotl32(s->seed[1] ^ s->seed[2], 12);
-    s->seed[0] += s->seed[1]; s->seed[3] = rotl32(s->seed[3] ^ s->seed[0], 8);
-    s->seed[2] += s->seed[3]; s->seed[1] = rotl32(s->seed[1] ^ s->seed[2], 7);
-    return s->seed[1];
+    return nk_tyche_next(s->seed);
 }
-
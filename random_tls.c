@@ -0,0 +1,154 @@
+/* random_tls.c - fork-safe per-thread random generators
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "nk/random_tls.h"
+#include "nk/random.h"
+#include "nk/csprng.h"
+#include "nk/log.h"
+
+#ifndef MADV_WIPEONFORK
+#define MADV_WIPEONFORK 18
+#endif
+
+// The ready flags are zero in a freshly mapped page and in a page that has
+// been wiped by fork(), which is what triggers lazy (re)seeding.
+struct nk_random_tls {
+    uint32_t prng_ready;
+    uint32_t csprng_ready;
+    struct nk_random_state prng;
+    struct nk_csprng csprng;
+};
+
+static __thread struct nk_random_tls *nk_rtls;
+static pthread_once_t nk_rtls_once = PTHREAD_ONCE_INIT;
+static pthread_key_t nk_rtls_key;
+static pthread_once_t nk_rtls_atfork_once = PTHREAD_ONCE_INIT;
+
+static void nk_rtls_wipe(struct nk_random_tls *t)
+{
+    memset(t, 0, sizeof *t);
+    __asm__ __volatile__("" : : "r"(t) : "memory");
+}
+
+static void nk_rtls_destroy(void *p)
+{
+    if (nk_rtls == p)
+        nk_rtls = NULL;
+    nk_rtls_wipe(p);
+    munmap(p, sizeof(struct nk_random_tls));
+}
+
+static void nk_rtls_atfork_child(void)
+{
+    // Only the forking thread survives into the child.
+    if (nk_rtls)
+        nk_rtls_wipe(nk_rtls);
+}
+
+static void nk_rtls_register_atfork(void)
+{
+    if (pthread_atfork(NULL, NULL, nk_rtls_atfork_child))
+        suicide("%s: pthread_atfork failed", __func__);
+}
+
+static void nk_rtls_init_once(void)
+{
+    if (pthread_key_create(&nk_rtls_key, nk_rtls_destroy))
+        suicide("%s: pthread_key_create failed", __func__);
+}
+
+static struct nk_random_tls *nk_rtls_alloc(void)
+{
+    pthread_once(&nk_rtls_once, nk_rtls_init_once);
+    void *p = mmap(NULL, sizeof(struct nk_random_tls), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        suicide("%s: mmap failed: %s", __func__, strerror(errno));
+    if (madvise(p, sizeof(struct nk_random_tls), MADV_WIPEONFORK)) {
+        if (errno != EINVAL)
+            suicide("%s: madvise(MADV_WIPEONFORK) failed: %s", __func__,
+                    strerror(errno));
+        pthread_once(&nk_rtls_atfork_once, nk_rtls_register_atfork);
+    }
+#ifdef MADV_DONTDUMP
+    (void)madvise(p, sizeof(struct nk_random_tls), MADV_DONTDUMP);
+#endif
+    if (pthread_setspecific(nk_rtls_key, p))
+        suicide("%s: pthread_setspecific failed", __func__);
+    nk_rtls = p;
+    return p;
+}
+
+static inline struct nk_random_tls *nk_rtls_get(void)
+{
+    struct nk_random_tls *t = nk_rtls;
+    return t ? t : nk_rtls_alloc();
+}
+
+static inline struct nk_random_state *nk_rtls_prng(void)
+{
+    struct nk_random_tls *t = nk_rtls_get();
+    if (__builtin_expect(!t->prng_ready, 0)) {
+        nk_random_init(&t->prng);
+        t->prng_ready = 1;
+    }
+    return &t->prng;
+}
+
+static inline struct nk_csprng *nk_rtls_csprng(void)
+{
+    struct nk_random_tls *t = nk_rtls_get();
+    if (__builtin_expect(!t->csprng_ready, 0)) {
+        nk_csprng_init(&t->csprng);
+        t->csprng_ready = 1;
+    }
+    return &t->csprng;
+}
+
+uint32_t nk_random_tls_u32(void) { return nk_random_u32(nk_rtls_prng()); }
+uint64_t nk_random_tls_u64(void) { return nk_random_u64(nk_rtls_prng()); }
+uint32_t nk_random_tls_bounded(uint32_t range)
+{
+    return nk_random_bounded(nk_rtls_prng(), range);
+}
+
+void nk_csprng_tls_get(void *out, size_t len)
+{
+    nk_csprng_get(nk_rtls_csprng(), out, len);
+}
+uint32_t nk_csprng_tls_u32(void) { return nk_csprng_u32(nk_rtls_csprng()); }
+uint64_t nk_csprng_tls_u64(void) { return nk_csprng_u64(nk_rtls_csprng()); }
@@ -0,0 +1,288 @@
+/* seccomp.c - seccomp-bpf filter construction
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include "nk/seccomp.h"
+#include "nk/malloc.h"
+#include "nk/log.h"
+
+#if defined(__x86_64__) && defined(__ILP32__)
+#define NK_SECCOMP_ARCH AUDIT_ARCH_X86_64
+#define NK_SECCOMP_NR_MIN 0x40000000u
+#define NK_SECCOMP_NR_END 0x80000000u
+#elif defined(__x86_64__)
+#define NK_SECCOMP_ARCH AUDIT_ARCH_X86_64
+#define NK_SECCOMP_NR_MIN 0u
+#define NK_SECCOMP_NR_END 0x40000000u // x32 syscalls have bit 30 set
+#elif defined(__i386__)
+#define NK_SECCOMP_ARCH AUDIT_ARCH_I386
+#elif defined(__aarch64__)
+#define NK_SECCOMP_ARCH AUDIT_ARCH_AARCH64
+#elif defined(__arm__) && defined(__ARMEB__)
+#define NK_SECCOMP_ARCH AUDIT_ARCH_ARMEB
+#elif defined(__arm__)
+#define NK_SECCOMP_ARCH AUDIT_ARCH_ARM
+#elif defined(__riscv) && __riscv_xlen == 64
+#define NK_SECCOMP_ARCH AUDIT_ARCH_RISCV64
+#elif defined(__powerpc64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define NK_SECCOMP_ARCH AUDIT_ARCH_PPC64LE
+#elif defined(__powerpc64__)
+#define NK_SECCOMP_ARCH AUDIT_ARCH_PPC64
+#elif defined(__s390x__)
+#define NK_SECCOMP_ARCH AUDIT_ARCH_S390X
+#endif
+#ifndef NK_SECCOMP_NR_MIN
+#define NK_SECCOMP_NR_MIN 0u
+#endif
+
+#ifndef SECCOMP_SET_MODE_FILTER
+#define SECCOMP_SET_MODE_FILTER 1
+#endif
+#ifndef SECCOMP_FILTER_FLAG_TSYNC
+#define SECCOMP_FILTER_FLAG_TSYNC 1
+#endif
+
+// The syscall number space is partitioned into segments; segment i covers
+// [seg[i].lo, seg[i + 1].lo) and seg[0].lo is 0.
+struct nk_seccomp_seg {
+    uint32_t lo;
+    uint32_t action;
+};
+
+static bool nk_seccomp_valid_nr(int nr)
+{
+    if (nr < 0)
+        return false;
+#if NK_SECCOMP_NR_MIN > 0
+    if ((uint32_t)nr < NK_SECCOMP_NR_MIN)
+        return false;
+#endif
+#ifdef NK_SECCOMP_NR_END
+    if ((uint32_t)nr >= NK_SECCOMP_NR_END)
+        return false;
+#endif
+    return true;
+}
+
+static int nk_seccomp_rule_cmp(const void *x, const void *y)
+{
+    const struct nk_seccomp_rule *a = x, *b = y;
+    return (a->nr > b->nr) - (a->nr < b->nr);
+}
+
+static void nk_seccomp_push(struct nk_seccomp_seg *s, size_t *n, uint32_t lo,
+                            uint32_t action)
+{
+    if (*n && s[*n - 1].action == action)
+        return; // extends the previous segment
+    s[*n] = (struct nk_seccomp_seg){ .lo = lo, .action = action };
+    ++*n;
+}
+
+// Instructions needed for the search tree over seg[lo, hi).
+static size_t nk_seccomp_tree_len(const struct nk_seccomp_seg *seg,
+                                  size_t lo, size_t hi)
+{
+    if (hi - lo == 1)
+        return 1;
+    size_t mid = lo + (hi - lo) / 2;
+    size_t l = nk_seccomp_tree_len(seg, lo, mid);
+    return 1 + (l > 255) + l + nk_seccomp_tree_len(seg, mid, hi);
+}
+
+// Emits a balanced binary search over seg[lo, hi): each inner node tests
+// nr >= seg[mid].lo with the left subtree placed directly after it, and
+// each leaf returns a segment's action.  Conditional jump offsets are only
+// eight bits wide, so a left subtree longer than 255 instructions is
+// skipped with an unconditional jump instead.
+static struct sock_filter *nk_seccomp_emit(struct sock_filter *f,
+                                           const struct nk_seccomp_seg *seg,
+                                           size_t lo, size_t hi)
+{
+    if (hi - lo == 1) {
+        *f++ = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, seg[lo].action);
+        return f;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    size_t l = nk_seccomp_tree_len(seg, lo, mid);
+    if (l > 255) {
+        *f++ = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K,
+                                            seg[mid].lo, 0, 1);
+        *f++ = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JA, (uint32_t)l, 0, 0);
+    } else {
+        *f++ = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K,
+                                            seg[mid].lo, (uint8_t)l, 0);
+    }
+    f = nk_seccomp_emit(f, seg, lo, mid);
+    return nk_seccomp_emit(f, seg, mid, hi);
+}
+
+/*
+ * Compiles rules into a seccomp-bpf program.  The program kills the
+ * process if the syscall is not made with the native calling convention
+ * (including x32 calls on x86-64), returns the rule's action for syscalls
+ * that have one, and default_action otherwise.  Runs of consecutive
+ * syscall numbers with the same action are merged, and the remaining
+ * ranges are searched with a balanced tree, so a syscall is classified in
+ * O(log n) comparisons rather than one per rule.
+ *
+ * Returns 0 and sets *filter (to be freed with free()) and *len, or
+ * EINVAL if a syscall number is invalid or given conflicting actions,
+ * E2BIG if the program is too long, or ENOSYS on unknown architectures.
+ */
+int nk_seccomp_build(const struct nk_seccomp_rule *rules, size_t n,
+                     uint32_t default_action, struct sock_filter **filter,
+                     size_t *len)
+{
+#ifndef NK_SECCOMP_ARCH
+    (void)rules; (void)n; (void)default_action; (void)filter; (void)len;
+    return ENOSYS;
+#else
+    if (n > BPF_MAXINSNS)
+        return E2BIG;
+    struct nk_seccomp_rule *r = xmalloc((n ? n : 1) * sizeof *r);
+    if (n) memcpy(r, rules, n * sizeof *r);
+    qsort(r, n, sizeof *r, nk_seccomp_rule_cmp);
+
+    // At most one default segment before each rule, plus the ends.
+    struct nk_seccomp_seg *seg = xmalloc((2 * n + 3) * sizeof *seg);
+    size_t nseg = 0;
+    uint64_t cur = 0;
+    if (NK_SECCOMP_NR_MIN) {
+        nk_seccomp_push(seg, &nseg, 0, SECCOMP_RET_KILL_PROCESS);
+        cur = NK_SECCOMP_NR_MIN;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (!nk_seccomp_valid_nr(r[i].nr)
+            || (i && r[i].nr == r[i - 1].nr && r[i].action != r[i - 1].action)) {
+            free(seg);
+            free(r);
+            return EINVAL;
+        }
+        const uint32_t nr = (uint32_t)r[i].nr;
+        if (nr > cur)
+            nk_seccomp_push(seg, &nseg, (uint32_t)cur, default_action);
+        nk_seccomp_push(seg, &nseg, nr, r[i].action);
+        cur = (uint64_t)nr + 1;
+    }
+#ifdef NK_SECCOMP_NR_END
+    if (cur < NK_SECCOMP_NR_END)
+        nk_seccomp_push(seg, &nseg, (uint32_t)cur, default_action);
+    nk_seccomp_push(seg, &nseg, NK_SECCOMP_NR_END, SECCOMP_RET_KILL_PROCESS);
+#else
+    nk_seccomp_push(seg, &nseg, (uint32_t)cur, default_action);
+#endif
+    free(r);
+
+    const size_t head = 4;
+    size_t tlen = nk_seccomp_tree_len(seg, 0, nseg);
+    if (head + tlen > BPF_MAXINSNS) {
+        free(seg);
+        return E2BIG;
+    }
+    struct sock_filter *f = xmalloc((head + tlen) * sizeof *f);
+    f[0] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                        offsetof(struct seccomp_data, arch));
+    f[1] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                        NK_SECCOMP_ARCH, 1, 0);
+    f[2] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS);
+    f[3] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                        offsetof(struct seccomp_data, nr));
+    nk_seccomp_emit(f + head, seg, 0, nseg);
+    free(seg);
+    *filter = f;
+    *len = head + tlen;
+    return 0;
+#endif
+}
+
+/*
+ * Builds and installs a filter as with nk_seccomp_build(), synchronized
+ * across all threads where the kernel supports it.  Sets NO_NEW_PRIVS,
+ * which installing a filter without CAP_SYS_ADMIN requires; call it after
+ * nk_set_uidgid().  Exits via suicide() on failure.
+ */
+void nk_seccomp_install(const struct nk_seccomp_rule *rules, size_t n,
+                        uint32_t default_action)
+{
+    struct sock_filter *f;
+    size_t len;
+    int r = nk_seccomp_build(rules, n, default_action, &f, &len);
+    if (r)
+        suicide("%s: building filter failed: %s", __func__, strerror(r));
+    struct sock_fprog prog = { .len = (unsigned short)len, .filter = f };
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0))
+        suicide("%s: prctl failed: %s", __func__, strerror(errno));
+#ifdef SYS_seccomp
+    // With TSYNC, a positive return is the id of a thread that could not
+    // be synchronized; errno is not set then.
+    long sr = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER,
+                      SECCOMP_FILTER_FLAG_TSYNC, &prog);
+    if (sr == 0) {
+        free(f);
+        return;
+    }
+    if (sr > 0)
+        suicide("%s: seccomp TSYNC failed on thread %ld", __func__, sr);
+    if (errno != ENOSYS && errno != EINVAL)
+        suicide("%s: seccomp failed: %s", __func__, strerror(errno));
+#endif
+    if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog))
+        suicide("%s: prctl failed: %s", __func__, strerror(errno));
+    free(f);
+}
+
+// Installs a filter that allows the syscalls in nrs and takes
+// default_action for all others.
+void nk_seccomp_allow(const int *nrs, size_t n, uint32_t default_action)
+{
+    struct nk_seccomp_rule *r = xmalloc((n ? n : 1) * sizeof *r);
+    for (size_t i = 0; i < n; ++i)
+        r[i] = (struct nk_seccomp_rule){ .nr = nrs[i], .action = SECCOMP_RET_ALLOW };
+    nk_seccomp_install(r, n, default_action);
+    free(r);
+}
+
+#endif
@@ -0,0 +1,474 @@
+/* supervise.c - pidfd-based child supervision
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include "nk/supervise.h"
+#include "nk/exec.h"
+#include "nk/malloc.h"
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+
+#define NK_SV_MAX_EPOLL 64
+
+struct nk_child {
+    struct nk_child *prev, *next;   // all children
+    struct nk_child *pnext;         // children awaiting restart
+    const struct nk_command *cmd;   // NULL if adopted
+    char * const *envp;
+    struct nk_spawn_opts opts;
+    struct nk_restart_opts ropts;
+    void *ctx;
+    uint64_t started_ms;
+    uint64_t restart_at_ms;
+    unsigned delay_ms;
+    unsigned restarts;
+    pid_t pid;
+    int pidfd;                      // -1 while awaiting restart
+    bool restartable;
+};
+
+struct nk_supervisor {
+    struct nk_child *head;
+    struct nk_child *pending;
+    int epfd;
+    int tfd;
+    int err; // deferred error from a call that also returned events
+};
+
+static uint64_t nk_sv_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void nk_sv_unlink(struct nk_supervisor *sv, struct nk_child *c)
+{
+    if (c->prev) c->prev->next = c->next;
+    else sv->head = c->next;
+    if (c->next) c->next->prev = c->prev;
+}
+
+static void nk_sv_unpend(struct nk_supervisor *sv, struct nk_child *c)
+{
+    for (struct nk_child **p = &sv->pending; *p; p = &(*p)->pnext) {
+        if (*p == c) {
+            *p = c->pnext;
+            c->pnext = NULL;
+            return;
+        }
+    }
+}
+
+// Arms the timerfd for the earliest pending restart, or disarms it.
+static void nk_sv_arm(struct nk_supervisor *sv)
+{
+    struct itimerspec its = {0};
+    uint64_t at = UINT64_MAX;
+    for (struct nk_child *c = sv->pending; c; c = c->pnext)
+        if (c->restart_at_ms < at) at = c->restart_at_ms;
+    if (at != UINT64_MAX) {
+        its.it_value.tv_sec = (time_t)(at / 1000);
+        its.it_value.tv_nsec = (long)(at % 1000) * 1000000;
+        // An absolute time in the past fires at once; zero would disarm.
+        if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+            its.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(sv->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static int nk_sv_register(struct nk_supervisor *sv, struct nk_child *c)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if (epoll_ctl(sv->epfd, EPOLL_CTL_ADD, c->pidfd, &ev))
+        return errno;
+    return 0;
+}
+
+static int nk_sv_start(struct nk_supervisor *sv, struct nk_child *c)
+{
+    struct nk_spawn_opts o = c->opts;
+    int pidfd = -1;
+    o.pidfd = &pidfd;
+    int r = nk_command_spawn(&c->pid, c->cmd, c->envp, &o);
+    if (r)
+        return r;
+    c->pidfd = pidfd;
+    c->started_ms = nk_sv_now_ms();
+    r = nk_sv_register(sv, c);
+    if (r) {
+        syscall(SYS_pidfd_send_signal, c->pidfd, SIGKILL, NULL, 0);
+        syscall(SYS_waitid, P_PIDFD, c->pidfd, NULL, WEXITED, NULL);
+        close(c->pidfd);
+        c->pidfd = -1;
+    }
+    return r;
+}
+
+// Queues c for restart if its policy allows another attempt.
+static bool nk_sv_schedule(struct nk_supervisor *sv, struct nk_child *c,
+                           uint64_t now, bool failed)
+{
+    if (!c->restartable)
+        return false;
+    switch (c->ropts.policy) {
+    case NK_RESTART_ALWAYS: break;
+    case NK_RESTART_ON_FAILURE: if (failed) break; return false;
+    default: return false;
+    }
+    if (c->ropts.reset_ms && c->pidfd >= 0
+        && now - c->started_ms >= c->ropts.reset_ms) {
+        c->delay_ms = c->ropts.delay_ms;
+        c->restarts = 0;
+    }
+    if (c->ropts.max_restarts && c->restarts >= c->ropts.max_restarts)
+        return false;
+    c->restart_at_ms = now + c->delay_ms;
+    uint64_t d = (uint64_t)c->delay_ms * 2;
+    c->delay_ms = d > c->ropts.max_delay_ms ? c->ropts.max_delay_ms : (unsigned)d;
+    if (c->delay_ms < c->ropts.delay_ms)
+        c->delay_ms = c->ropts.delay_ms;
+    c->pnext = sv->pending;
+    sv->pending = c;
+    return true;
+}
+
+struct nk_supervisor *nk_supervisor_new(void)
+{
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        return NULL;
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (tfd < 0)
+        goto err;
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct nk_supervisor *sv = xmalloc(sizeof *sv);
+    ev.data.ptr = sv;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev)) {
+        int e = errno;
+        free(sv);
+        close(tfd);
+        errno = e;
+        goto err;
+    }
+    sv->head = NULL;
+    sv->pending = NULL;
+    sv->epfd = epfd;
+    sv->tfd = tfd;
+    sv->err = 0;
+    return sv;
+err:
+    {
+        int e = errno;
+        close(epfd);
+        errno = e;
+    }
+    return NULL;
+}
+
+// If sig is nonzero, it is sent to every running child, which is then
+// reaped.  Otherwise, running children are no longer watched and must be
+// reaped by other means.
+void nk_supervisor_free(struct nk_supervisor *sv, int sig)
+{
+    if (!sv)
+        return;
+    for (struct nk_child *c = sv->head, *n; c; c = n) {
+        n = c->next;
+        if (c->pidfd >= 0) {
+            if (sig && !syscall(SYS_pidfd_send_signal, c->pidfd, sig, NULL, 0)) {
+                siginfo_t si;
+                while (syscall(SYS_waitid, P_PIDFD, c->pidfd, &si, WEXITED, NULL) < 0
+                       && errno == EINTR);
+            }
+            close(c->pidfd);
+        }
+        free(c);
+    }
+    close(sv->tfd);
+    close(sv->epfd);
+    free(sv);
+}
+
+// Returns an fd that becomes readable when nk_supervisor_wait() has work.
+int nk_supervisor_fd(const struct nk_supervisor *sv)
+{
+    return sv->epfd;
+}
+
+/*
+ * Spawns cmd as with nk_command_spawn() and watches it.  cmd, envp and the
+ * arrays referenced by opts must remain valid for as long as the child may
+ * be restarted; opts->pidfd is ignored and NK_SPAWN_F_SIBLING is not
+ * allowed.  If ropts is NULL, the child is not restarted.  ctx is
+ * returned in each event for the child.
+ *
+ * Returns 0 and sets *child (if non-NULL) on success, or an errno value.
+ */
+int nk_supervisor_spawn(struct nk_supervisor *sv, struct nk_child **child,
+                        const struct nk_command *cmd, char * const envp[],
+                        const struct nk_spawn_opts *opts,
+                        const struct nk_restart_opts *ropts, void *ctx)
+{
+    if (opts && (opts->flags & NK_SPAWN_F_SIBLING))
+        return EINVAL;
+    struct nk_child *c = xmalloc(sizeof *c);
+    memset(c, 0, sizeof *c);
+    c->cmd = cmd;
+    c->envp = envp;
+    if (opts) {
+        c->opts = *opts;
+    } else {
+        c->opts.uid = (uid_t)-1;
+        c->opts.gid = (gid_t)-1;
+    }
+    if (ropts) {
+        c->ropts = *ropts;
+        c->restartable = true;
+    }
+    c->delay_ms = c->ropts.delay_ms;
+    c->ctx = ctx;
+    c->pidfd = -1;
+    int r = nk_sv_start(sv, c);
+    if (r) {
+        free(c);
+        return r;
+    }
+    c->next = sv->head;
+    if (sv->head) sv->head->prev = c;
+    sv->head = c;
+    if (child) *child = c;
+    return 0;
+}
+
+/*
+ * Watches an existing child of the calling process.  If pidfd is negative,
+ * one is opened for pid; otherwise the supervisor takes ownership of pidfd.
+ * Adopted children are never restarted.
+ *
+ * Returns 0 and sets *child (if non-NULL) on success, or an errno value.
+ */
+int nk_supervisor_watch(struct nk_supervisor *sv, struct nk_child **child,
+                        pid_t pid, int pidfd, void *ctx)
+{
+    if (pidfd < 0) {
+        pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+        if (pidfd < 0)
+            return errno;
+    }
+    struct nk_child *c = xmalloc(sizeof *c);
+    memset(c, 0, sizeof *c);
+    c->ctx = ctx;
+    c->pid = pid;
+    c->pidfd = pidfd;
+    c->started_ms = nk_sv_now_ms();
+    int r = nk_sv_register(sv, c);
+    if (r) {
+        close(pidfd);
+        free(c);
+        return r;
+    }
+    c->next = sv->head;
+    if (sv->head) sv->head->prev = c;
+    sv->head = c;
+    if (child) *child = c;
+    return 0;
+}
+
+// Sends sig to child without any pid-reuse race.  Returns 0, or ESRCH if
+// the child is awaiting restart, or another errno value.
+int nk_supervisor_signal(struct nk_child *child, int sig)
+{
+    if (child->pidfd < 0)
+        return ESRCH;
+    if (syscall(SYS_pidfd_send_signal, child->pidfd, sig, NULL, 0))
+        return errno;
+    return 0;
+}
+
+// Stops restarting child.  If it is awaiting restart, it is released at
+// once; otherwise its next exit is reported as final.
+void nk_supervisor_forget(struct nk_supervisor *sv, struct nk_child *child)
+{
+    child->restartable = false;
+    if (child->pidfd < 0) {
+        nk_sv_unpend(sv, child);
+        nk_sv_arm(sv);
+        nk_sv_unlink(sv, child);
+        free(child);
+    }
+}
+
+pid_t nk_child_pid(const struct nk_child *child)
+{
+    return child->pid;
+}
+
+static void nk_sv_reap(struct nk_supervisor *sv, struct nk_child *c,
+                       struct nk_child_event *e, uint64_t now)
+{
+    siginfo_t si;
+    memset(e, 0, sizeof *e);
+    memset(&si, 0, sizeof si);
+    e->type = NK_CHILD_EXITED;
+    e->child = c;
+    e->ctx = c->ctx;
+    e->pid = c->pid;
+    if (syscall(SYS_waitid, P_PIDFD, c->pidfd, &si, WEXITED | WNOHANG,
+                &e->rusage) < 0) {
+        // Most likely ECHILD: someone else reaped the child.
+        e->err = errno;
+    } else {
+        e->code = si.si_code;
+        e->status = si.si_status;
+    }
+    epoll_ctl(sv->epfd, EPOLL_CTL_DEL, c->pidfd, NULL);
+    bool failed = e->err || e->code != CLD_EXITED || e->status != 0;
+    e->final = !nk_sv_schedule(sv, c, now, failed);
+    close(c->pidfd);
+    c->pidfd = -1;
+    if (e->final) {
+        nk_sv_unlink(sv, c);
+        free(c);
+    }
+}
+
+// Starts due restarts, writing at most n events.  Returns the count.
+static size_t nk_sv_restart_due(struct nk_supervisor *sv,
+                                struct nk_child_event *ev, size_t n)
+{
+    uint64_t now = nk_sv_now_ms();
+    size_t k = 0;
+    for (struct nk_child **p = &sv->pending; *p && k < n;) {
+        struct nk_child *c = *p;
+        if (c->restart_at_ms > now) {
+            p = &c->pnext;
+            continue;
+        }
+        *p = c->pnext;
+        c->pnext = NULL;
+        struct nk_child_event *e = &ev[k++];
+        memset(e, 0, sizeof *e);
+        e->child = c;
+        e->ctx = c->ctx;
+        ++c->restarts;
+        int r = nk_sv_start(sv, c);
+        if (!r) {
+            e->type = NK_CHILD_RESTARTED;
+            e->pid = c->pid;
+            continue;
+        }
+        e->type = NK_CHILD_RESTART_FAILED;
+        e->err = r;
+        e->final = !nk_sv_schedule(sv, c, now, true);
+        if (e->final) {
+            nk_sv_unlink(sv, c);
+            free(c);
+        } else if (sv->pending == c) {
+            // Rescheduled at the list head, behind the cursor.
+            p = p == &sv->pending ? &c->pnext : p;
+        }
+    }
+    return k;
+}
+
+/*
+ * Waits up to timeout_ms (-1 for no limit, 0 to poll) for children to
+ * exit or for restarts to become due, and writes at most n events to ev.
+ * Only children that have exited are examined.  Returns the number of
+ * events, which may be 0, or -1 with errno set.  An error that occurs
+ * after events have been collected is reported by the next call instead,
+ * so that those events are not lost.
+ */
+int nk_supervisor_wait(struct nk_supervisor *sv, struct nk_child_event *ev,
+                       size_t n, int timeout_ms)
+{
+    struct epoll_event eps[NK_SV_MAX_EPOLL];
+    if (!n) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (sv->err) {
+        errno = sv->err;
+        sv->err = 0;
+        return -1;
+    }
+    int maxev = n < NK_SV_MAX_EPOLL ? (int)n : NK_SV_MAX_EPOLL;
+    int r = epoll_wait(sv->epfd, eps, maxev, timeout_ms);
+    if (r < 0)
+        return -1;
+    uint64_t now = nk_sv_now_ms();
+    size_t k = 0;
+    bool timer = false;
+    for (int i = 0; i < r; ++i) {
+        if (eps[i].data.ptr == sv) {
+            timer = true;
+            continue;
+        }
+        nk_sv_reap(sv, eps[i].data.ptr, &ev[k++], now);
+    }
+    if (timer && k < n) {
+        uint64_t exp;
+        if (read(sv->tfd, &exp, sizeof exp) < 0 && errno != EAGAIN) {
+            if (!k)
+                return -1;
+            sv->err = errno;
+        } else {
+            k += nk_sv_restart_due(sv, ev + k, n - k);
+        }
+    }
+    nk_sv_arm(sv);
+    return (int)k;
+}
+
+#endif
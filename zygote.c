@@ -0,0 +1,421 @@
+/* zygote.c - pre-forked process launcher
+ *
+ * (c) 2018 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include "nk/zygote.h"
+#include "nk/exec.h"
+
+#define NK_ZYGOTE_MSG_MAX (64 * 1024)
+#define NK_ZYGOTE_MAX_ENV 32
+#define NK_ZYGOTE_ENVBUF 4096
+#define NK_ZYGOTE_FD 3
+
+enum nk_zygote_msg_type {
+    NK_ZYGOTE_READY,
+    NK_ZYGOTE_SPAWN,
+    NK_ZYGOTE_CONNECT,
+};
+
+// Header of every request and reply.  A spawn request is followed by the
+// command and, if argslen > 0, the arguments, each NUL-terminated and with
+// the NUL counted in its length.  Replies may carry one fd in SCM_RIGHTS.
+struct nk_zygote_msg {
+    uint32_t type;
+    int32_t err;
+    int32_t pid;
+    uint32_t cmdlen;
+    uint32_t argslen;
+};
+
+// Sends hdr, followed by the strings a and b (each may be NULL) with their
+// terminating NULs, and optionally an fd.  Returns 0 or an errno value.
+static int nk_zygote_send(int fd, const struct nk_zygote_msg *hdr,
+                          const char *a, const char *b, int sendfd)
+{
+    struct iovec iov[3] = {
+        { .iov_base = (void *)hdr, .iov_len = sizeof *hdr },
+    };
+    size_t niov = 1;
+    if (a)
+        iov[niov++] = (struct iovec){ .iov_base = (void *)a, .iov_len = strlen(a) + 1 };
+    if (b)
+        iov[niov++] = (struct iovec){ .iov_base = (void *)b, .iov_len = strlen(b) + 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } cbuf;
+    struct msghdr mh = { .msg_iov = iov, .msg_iovlen = niov };
+    if (sendfd >= 0) {
+        memset(&cbuf, 0, sizeof cbuf);
+        mh.msg_control = cbuf.buf;
+        mh.msg_controllen = sizeof cbuf.buf;
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &sendfd, sizeof sendfd);
+    }
+    for (;;) {
+        if (sendmsg(fd, &mh, MSG_NOSIGNAL) >= 0)
+            return 0;
+        if (errno != EINTR)
+            return errno;
+    }
+}
+
+// Receives a message into buf.  Returns its length, 0 on EOF, or -1 with
+// errno set.  *recvfd is set to a received fd or -1.
+static ssize_t nk_zygote_recv(int fd, void *buf, size_t buflen, int *recvfd)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = buflen };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } cbuf;
+    struct msghdr mh = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = cbuf.buf, .msg_controllen = sizeof cbuf.buf,
+    };
+    ssize_t r;
+    *recvfd = -1;
+    do {
+        r = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0)
+        return -1;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS
+            && cm->cmsg_len == CMSG_LEN(sizeof(int)))
+            memcpy(recvfd, CMSG_DATA(cm), sizeof *recvfd);
+    }
+    if (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        if (*recvfd >= 0)
+            close(*recvfd);
+        *recvfd = -1;
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return r;
+}
+
+// Zygote process ---------------------------------------------------------
+
+static int nk_zygote_handle_spawn(int fd, const struct nk_zygote_msg *req,
+                                  size_t len, const struct nk_zygote_config *cfg,
+                                  char * const *envp)
+{
+    struct nk_zygote_msg rep = { .type = NK_ZYGOTE_SPAWN, .pid = -1 };
+    const char *cmd = (const char *)(req + 1);
+    const char *args = req->argslen ? cmd + req->cmdlen : NULL;
+    int pidfd = -1;
+    if (req->cmdlen == 0 || (size_t)req->cmdlen + req->argslen != len - sizeof *req
+        || cmd[req->cmdlen - 1] || (args && args[req->argslen - 1])) {
+        rep.err = EINVAL;
+    } else {
+        const struct nk_spawn_opts opts = {
+            .uid = cfg->uid, .gid = cfg->gid,
+            .pidfd = &pidfd, .flags = NK_SPAWN_F_SIBLING,
+        };
+        struct nk_command *c = nk_command_new(cmd, args);
+        pid_t pid = -1;
+        rep.err = nk_command_spawn(&pid, c, envp, &opts);
+        rep.pid = pid;
+        nk_command_free(c);
+    }
+    int r = nk_zygote_send(fd, &rep, NULL, NULL, rep.err ? -1 : pidfd);
+    if (pidfd >= 0)
+        close(pidfd);
+    return r;
+}
+
+static void __attribute__((noreturn))
+nk_zygote_main(int fd, const struct nk_zygote_config *cfg)
+{
+    static char *genv[NK_ZYGOTE_MAX_ENV];
+    static char genvbuf[NK_ZYGOTE_ENVBUF];
+    static union {
+        struct nk_zygote_msg m;
+        char raw[NK_ZYGOTE_MSG_MAX];
+    } msg;
+    char * const *envp = cfg->envp;
+    struct nk_zygote_msg ready = { .type = NK_ZYGOTE_READY };
+
+    if (!envp) {
+        uid_t uid = cfg->uid != (uid_t)-1 ? cfg->uid : getuid();
+        int r = nk_generate_env(uid, cfg->chroot_path, cfg->path_var, genv,
+                                NK_ZYGOTE_MAX_ENV, genvbuf, sizeof genvbuf);
+        if (r == -1) ready.err = ENOENT;
+        else if (r == -2 || r == -3) ready.err = E2BIG;
+        else if (r < 0) ready.err = errno;
+        envp = genv;
+    } else if (cfg->chroot_path) {
+        if (chroot(cfg->chroot_path) || chdir("/"))
+            ready.err = errno;
+    }
+    if (nk_zygote_send(fd, &ready, NULL, NULL, -1) || ready.err)
+        _exit(EXIT_FAILURE);
+
+    // pfds[0] is the connection to the process that started us; the zygote
+    // exits when it is closed.  That happens when the process exits,
+    // whichever of its threads started us, so no death signal is used.
+    struct pollfd *pfds = malloc(sizeof *pfds);
+    size_t npfds = 1, cap = 1;
+    if (!pfds)
+        _exit(EXIT_FAILURE);
+    pfds[0] = (struct pollfd){ .fd = fd, .events = POLLIN };
+    for (;;) {
+        if (poll(pfds, npfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            _exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < npfds; ++i) {
+            if (!pfds[i].revents)
+                continue;
+            int cfd = pfds[i].fd, rfd;
+            ssize_t len = nk_zygote_recv(cfd, msg.raw, sizeof msg.raw, &rfd);
+            if (rfd >= 0)
+                close(rfd);
+            if (len <= 0 && !(len < 0 && errno == EMSGSIZE)) {
+                if (i == 0)
+                    _exit(EXIT_SUCCESS);
+                close(cfd);
+                pfds[i--] = pfds[--npfds];
+                continue;
+            }
+            const struct nk_zygote_msg *req = &msg.m;
+            struct nk_zygote_msg rep = { .type = NK_ZYGOTE_CONNECT };
+            if (len < (ssize_t)sizeof *req) {
+                rep.err = EMSGSIZE;
+                nk_zygote_send(cfd, &rep, NULL, NULL, -1);
+            } else if (req->type == NK_ZYGOTE_SPAWN) {
+                nk_zygote_handle_spawn(cfd, req, (size_t)len, cfg, envp);
+            } else if (req->type == NK_ZYGOTE_CONNECT) {
+                int sv[2];
+                if (npfds == cap) {
+                    struct pollfd *n = realloc(pfds, 2 * cap * sizeof *pfds);
+                    if (n) {
+                        pfds = n;
+                        cap *= 2;
+                    }
+                }
+                if (npfds == cap) {
+                    rep.err = ENOMEM;
+                } else if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+                    rep.err = errno;
+                } else {
+                    pfds[npfds++] = (struct pollfd){ .fd = sv[0], .events = POLLIN };
+                }
+                nk_zygote_send(cfd, &rep, NULL, NULL, rep.err ? -1 : sv[1]);
+                if (!rep.err)
+                    close(sv[1]);
+            } else {
+                rep.type = req->type;
+                rep.err = EINVAL;
+                nk_zygote_send(cfd, &rep, NULL, NULL, -1);
+            }
+        }
+    }
+}
+
+// Leaves only stdin, stdout, stderr and the socket, as NK_ZYGOTE_FD.
+static int nk_zygote_close_fds(int fd)
+{
+    if (fd != NK_ZYGOTE_FD) {
+        if (dup3(fd, NK_ZYGOTE_FD, O_CLOEXEC) < 0)
+            return -1;
+        close(fd);
+    }
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, NK_ZYGOTE_FD + 1, ~0U, 0) == 0)
+        return 0;
+#endif
+    long maxfd = sysconf(_SC_OPEN_MAX);
+    if (maxfd < 0 || maxfd > 65536)
+        maxfd = 65536;
+    for (int i = NK_ZYGOTE_FD + 1; i < maxfd; ++i)
+        close(i);
+    return 0;
+}
+
+// Client side -----------------------------------------------------------
+
+/*
+ * Starts a zygote process as a child of the caller.
+ *
+ * returns:
+ * 0 on success, with z->fd connected to the zygote
+ * an errno value if the zygote could not be started or could not resolve
+ * the credentials or environment; ENOENT if uid has no passwd entry
+ */
+int nk_zygote_start(struct nk_zygote *z, const struct nk_zygote_config *cfg)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv))
+        return errno;
+    pid_t pid = fork();
+    if (pid < 0) {
+        int err = errno;
+        close(sv[0]);
+        close(sv[1]);
+        return err;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        for (int sig = 1; sig < NSIG; ++sig) {
+            struct sigaction sa;
+            if (sigaction(sig, NULL, &sa) || sa.sa_handler == SIG_IGN
+                || sa.sa_handler == SIG_DFL)
+                continue;
+            memset(&sa, 0, sizeof sa);
+            sa.sa_handler = SIG_DFL;
+            sigaction(sig, &sa, NULL);
+        }
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        if (nk_zygote_close_fds(sv[1]))
+            _exit(EXIT_FAILURE);
+        nk_zygote_main(NK_ZYGOTE_FD, cfg);
+    }
+    close(sv[1]);
+    struct nk_zygote_msg ready;
+    int rfd;
+    ssize_t r = nk_zygote_recv(sv[0], &ready, sizeof ready, &rfd);
+    if (rfd >= 0)
+        close(rfd);
+    int err = r == (ssize_t)sizeof ready ? ready.err : (r < 0 ? errno : EPIPE);
+    if (err) {
+        close(sv[0]);
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+        return err;
+    }
+    z->pid = pid;
+    z->fd = sv[0];
+    return 0;
+}
+
+// Sets *newfd to a new, independent connection to the zygote behind fd.
+// Returns 0 or an errno value.
+int nk_zygote_connect(int fd, int *newfd)
+{
+    struct nk_zygote_msg req = { .type = NK_ZYGOTE_CONNECT }, rep;
+    int err = nk_zygote_send(fd, &req, NULL, NULL, -1);
+    if (err)
+        return err;
+    ssize_t r = nk_zygote_recv(fd, &rep, sizeof rep, newfd);
+    if (r != (ssize_t)sizeof rep) {
+        err = r < 0 ? errno : EPIPE;
+    } else if (rep.err) {
+        err = rep.err;
+    } else if (*newfd < 0) {
+        err = EPROTO;
+    }
+    if (err && *newfd >= 0) {
+        close(*newfd);
+        *newfd = -1;
+    }
+    return err;
+}
+
+/*
+ * Asks the zygote behind fd to launch command with args (parsed with the
+ * nk_execute() rules).  The child is a child of the process that started
+ * the zygote.
+ *
+ * pid: set to the child's pid on success
+ * pidfd: if non-NULL, set to a pidfd for the child on success, or -1
+ *
+ * returns 0 or an errno value, as for nk_spawn()
+ */
+int nk_zygote_spawn(int fd, const char *command, const char *args,
+                    pid_t *pid, int *pidfd)
+{
+    if (!command)
+        return EINVAL;
+    const size_t cmdlen = strlen(command) + 1;
+    const size_t argslen = args && *args ? strlen(args) + 1 : 0;
+    if (sizeof(struct nk_zygote_msg) + cmdlen + argslen > NK_ZYGOTE_MSG_MAX)
+        return E2BIG;
+    struct nk_zygote_msg req = {
+        .type = NK_ZYGOTE_SPAWN,
+        .cmdlen = (uint32_t)cmdlen, .argslen = (uint32_t)argslen,
+    }, rep;
+    int err = nk_zygote_send(fd, &req, command, argslen ? args : NULL, -1);
+    if (err)
+        return err;
+    int rfd;
+    ssize_t r = nk_zygote_recv(fd, &rep, sizeof rep, &rfd);
+    if (r != (ssize_t)sizeof rep) {
+        if (rfd >= 0)
+            close(rfd);
+        return r < 0 ? errno : EPIPE;
+    }
+    if (rep.err) {
+        if (rfd >= 0)
+            close(rfd);
+        // A child that was created but failed to exec is ours to reap.
+        if (rep.pid > 0)
+            while (waitpid(rep.pid, NULL, 0) < 0 && errno == EINTR);
+        return rep.err;
+    }
+    if (pid)
+        *pid = rep.pid;
+    if (pidfd)
+        *pidfd = rfd;
+    else if (rfd >= 0)
+        close(rfd);
+    return 0;
+}
+
+// Closes the connection to the zygote, which then exits, and reaps it.
+void nk_zygote_stop(struct nk_zygote *z)
+{
+    if (z->fd >= 0)
+        close(z->fd);
+    z->fd = -1;
+    if (z->pid > 0)
+        while (waitpid(z->pid, NULL, 0) < 0 && errno == EINTR);
+    z->pid = -1;
+}